@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+/*
+ * The table in use. Readers load it once per event; a new curve is built
+ * off to the side and swapped in whole. accel_readers counts lookups in
+ * flight on any thread, the old table is freed once none is left that may
+ * have loaded it.
+ */
+static _Atomic(struct accel_table *) accel_current;
+static atomic_uint accel_readers;
+
+static double accel_points_gain(const double *velocity, const double *gain, int count, double v)
+{
+    if (v <= velocity[0])
+        return gain[0];
+
+    for (int i = 1; i < count; i++) {
+        if (v <= velocity[i]) {
+            double t = (v - velocity[i - 1]) / (velocity[i] - velocity[i - 1]);
+            return gain[i - 1] + t * (gain[i] - gain[i - 1]);
+        }
+    }
+
+    return gain[count - 1];
+}
+
+/*
+ * Samples a curve into table->gain. Velocities are in libinput's 1000dpi
+ * units per millisecond.
+ *   linear:G            constant gain G
+ *   power:G:E           G below 1 unit/ms, G * v^(E-1) above it
+ *   points:V=G,V=G,...  piecewise linear through the points, flat outside
+ */
+static int accel_build(struct accel_table *table, const char *curve)
+{
+    double velocity[ACCEL_MAX_POINTS], gain[ACCEL_MAX_POINTS];
+    double scale, exponent, v;
+    const char *p;
+    char *end;
+    int count = 0, len = 0;
+
+    snprintf(table->curve, sizeof(table->curve), "%s", curve);
+
+    /* %n only counts when everything before it matched; the token has to end there */
+    if (sscanf(curve, "linear:%lf%n", &scale, &len) == 1 && !curve[len] && isfinite(scale)) {
+        for (int i = 0; i < ACCEL_TABLE_SIZE; i++)
+            table->gain[i] = scale;
+        return 0;
+    }
+
+    if (sscanf(curve, "power:%lf:%lf%n", &scale, &exponent, &len) == 2 && !curve[len] &&
+        isfinite(scale) && isfinite(exponent)) {
+        for (int i = 0; i < ACCEL_TABLE_SIZE; i++) {
+            v = i * (double)ACCEL_MAX_VELOCITY / ACCEL_TABLE_SIZE;
+            table->gain[i] = scale * pow(v > 1.0 ? v : 1.0, exponent - 1.0);
+        }
+        return 0;
+    }
+
+    if (!strncmp(curve, "points:", 7)) {
+        for (p = curve + 7; *p && count < ACCEL_MAX_POINTS; p = *end ? end + 1 : end) {
+            velocity[count] = strtod(p, &end);
+            if (end == p || *end != '=' || !isfinite(velocity[count]))
+                return -EINVAL;
+            p = end + 1;
+            gain[count] = strtod(p, &end);
+            if (end == p || !isfinite(gain[count]) || (*end && (*end != ',' || !end[1])) ||
+                (count && velocity[count] <= velocity[count - 1]))
+                return -EINVAL;
+            count++;
+        }
+        if (!count || *p)
+            return -EINVAL;
+
+        for (int i = 0; i < ACCEL_TABLE_SIZE; i++) {
+            v = i * (double)ACCEL_MAX_VELOCITY / ACCEL_TABLE_SIZE;
+            table->gain[i] = accel_points_gain(velocity, gain, count, v);
+        }
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+int accel_set(const char *curve)
+{
+    struct accel_table *table;
+    int ret;
+
+    table = malloc(sizeof(*table));
+    if (!table)
+        return -ENOMEM;
+
+    ret = accel_build(table, curve);
+    if (ret < 0) {
+        fprintf(stderr, "Invalid acceleration curve: %s\n", curve);
+        free(table);
+        return ret;
+    }
+
+    table = atomic_exchange(&accel_current, table);
+
+    /* A lookup takes nanoseconds, and every lookup that starts from here on sees the new table */
+    while (atomic_load(&accel_readers))
+        sched_yield();
+    free(table);
+
+    return 0;
+}
+
+/* Re-reads the first line of path as a curve */
+int accel_load(const char *path)
+{
+    char curve[ACCEL_CURVE_SIZE];
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open acceleration curve %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    if (!fgets(curve, sizeof(curve), file)) {
+        fprintf(stderr, "Empty acceleration curve %s\n", path);
+        fclose(file);
+        return -EINVAL;
+    }
+    fclose(file);
+
+    curve[strcspn(curve, "\r\n")] = '\0';
+    return accel_set(curve);
+}
+
+/* velocity in units/ms; one table index and no branches beyond the clamp */
+double accel_gain(double velocity)
+{
+    struct accel_table *table;
+    int index = velocity * (ACCEL_TABLE_SIZE / (double)ACCEL_MAX_VELOCITY);
+    double gain;
+
+    if (index >= ACCEL_TABLE_SIZE)
+        index = ACCEL_TABLE_SIZE - 1;
+
+    atomic_fetch_add(&accel_readers, 1);
+    table = atomic_load(&accel_current);
+    gain = table->gain[index];
+    atomic_fetch_sub_explicit(&accel_readers, 1, memory_order_release);
+
+    return gain;
+}
+
+const char *accel_curve(void)
+{
+    return atomic_load_explicit(&accel_current, memory_order_acquire)->curve;
+}
+
+void accel_close(void)
+{
+    free(atomic_exchange(&accel_current, NULL));
+}
@@ -0,0 +1,594 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <argp.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+/*
+ * Synthetic load for the whole pipeline. A generator thread drives a uinput
+ * touchpad and keyboard at a fixed rate while the main thread runs the usual
+ * epoll loop into memory sinks, then throughput, CPU per event, drops and
+ * latency are reported. Built and run by `make bench`, needs uinput access.
+ */
+
+#define BENCH_MAX_BURST 256
+#define BENCH_MAX_EVENTS (BENCH_MAX_BURST * 4 + 32)
+#define BENCH_FLING_FRAMES 64
+#define BENCH_FLING_STEP 15
+#define BENCH_CENTER_X 2000
+#define BENCH_CENTER_Y 1250
+#define BENCH_RADIUS 800
+
+enum bench_pattern {
+    BENCH_MOTION,
+    BENCH_SCROLL,
+    BENCH_KEYS,
+    BENCH_MIXED,
+    BENCH_PATTERN_MAX,
+};
+
+static const char *pattern_names[BENCH_PATTERN_MAX] = {
+    [BENCH_MOTION] = "motion",
+    [BENCH_SCROLL] = "scroll",
+    [BENCH_KEYS] = "keys",
+    [BENCH_MIXED] = "mixed",
+};
+
+/* Letters only, nothing that could complete a chord */
+static const uint16_t bench_keys[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+};
+
+struct bench_source {
+    struct libevdev_uinput *uinput;
+    struct input_event events[BENCH_MAX_EVENTS];
+    unsigned int count;
+    uint64_t written;
+    int tracking_id;
+    unsigned int key;
+};
+
+struct bench {
+    enum bench_pattern pattern;
+    unsigned int rate;
+    uint64_t duration_us;
+    unsigned int burst;
+    struct bench_source touchpad;
+    struct bench_source keyboard;
+    uint64_t ticks;
+    _Atomic bool done;
+};
+
+struct bench_arguments {
+    int pattern;
+    unsigned int rate;
+    double duration;
+    unsigned int burst;
+    enum mouse_backend backend;
+    bool json;
+};
+
+static char doc[] = {"Synthetic load benchmark for the virtual_mk pipeline."
+    "\vPatterns: motion circles one finger at --rate (8000 Hz by default), scroll repeats two-finger flings, "
+    "keys writes --burst presses and releases at once, more than the reader buffer holds, and mixed moves "
+    "with a key every tenth frame and a burst now and then. Each run reports events/s, CPU per event, "
+    "dropped frames and latency percentiles; --json prints one line per pattern for comparing builds, "
+    "e.g. make bench BENCH_ARGS=\"--json --rate 0\"."};
+
+static struct argp_option options[] = {
+    {"pattern", 'p', "motion|scroll|keys|mixed|all", 0, "Load pattern, all runs each in turn"},
+    {"rate", 'r', "Hz", 0, "Frames per second from the generator, 0 for as fast as possible"},
+    {"duration", 'd', "Seconds", 0, "Length of each run"},
+    {"burst", 'B', "Keys", 0, "Keys per keyboard burst, each a press and a release"},
+    {"backend", 'b', "libinput|native", 0, "Touchpad backend under test"},
+    {"json", 'j', 0, 0, "Print each summary as one line of JSON"},
+    {0},
+};
+
+/* A whole decimal number within [min, max], as virtual_mk.c takes its options */
+static int parse_int(const char *arg, int min, int max, int *value)
+{
+    char *end;
+    long number;
+
+    errno = 0;
+    number = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || number < min || number > max)
+        return -EINVAL;
+
+    *value = number;
+    return 0;
+}
+
+static error_t parse_options(int key, char *arg, struct argp_state *state)
+{
+    struct bench_arguments *a = state->input;
+    char *end;
+    int value;
+
+    switch (key)
+    {
+        case 'p':
+            a->pattern = -1;
+            for (int i = 0; i < BENCH_PATTERN_MAX; i++)
+                if (!strcmp(arg, pattern_names[i]))
+                    a->pattern = i;
+            if (!strcmp(arg, "all"))
+                a->pattern = BENCH_PATTERN_MAX;
+            if (a->pattern < 0)
+                argp_error(state, "Unknown pattern: %s", arg);
+            break;
+
+        case 'r':
+            if (parse_int(arg, 0, 1000000, &value) < 0)
+                argp_error(state, "Rate must be between 0 and 1000000 Hz");
+            a->rate = value;
+            break;
+
+        case 'd':
+            a->duration = strtod(arg, &end);
+            if (end == arg || *end || !(a->duration > 0 && a->duration <= 3600))
+                argp_error(state, "Duration must be above 0 and at most 3600 seconds");
+            break;
+
+        case 'B':
+            if (parse_int(arg, 1, BENCH_MAX_BURST, &value) < 0)
+                argp_error(state, "Burst must be between 1 and %d", BENCH_MAX_BURST);
+            a->burst = value;
+            break;
+
+        case 'b':
+            if (!strcmp(arg, "native"))
+                a->backend = MOUSE_BACKEND_NATIVE;
+            else if (!strcmp(arg, "libinput"))
+                a->backend = MOUSE_BACKEND_LIBINPUT;
+            else
+                argp_error(state, "Unknown backend: %s", arg);
+            break;
+
+        case 'j':
+            a->json = true;
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_options, NULL, doc };
+
+static int bench_create_touchpad(struct bench_source *source)
+{
+    struct input_absinfo slot = { .maximum = 4 };
+    struct input_absinfo tracking = { .maximum = 65535 };
+    struct input_absinfo x = { .maximum = 4000, .resolution = 40 };
+    struct input_absinfo y = { .maximum = 2500, .resolution = 40 };
+    struct libevdev *dev = libevdev_new();
+    int ret;
+
+    libevdev_set_name(dev, "virtual_mk bench touchpad");
+    libevdev_enable_property(dev, INPUT_PROP_POINTER);
+    libevdev_enable_property(dev, INPUT_PROP_BUTTONPAD);
+    libevdev_enable_event_code(dev, EV_KEY, BTN_LEFT, NULL);
+    libevdev_enable_event_code(dev, EV_KEY, BTN_TOUCH, NULL);
+    libevdev_enable_event_code(dev, EV_KEY, BTN_TOOL_FINGER, NULL);
+    libevdev_enable_event_code(dev, EV_KEY, BTN_TOOL_DOUBLETAP, NULL);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_X, &x);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_Y, &y);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_MT_SLOT, &slot);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_MT_TRACKING_ID, &tracking);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_MT_POSITION_X, &x);
+    libevdev_enable_event_code(dev, EV_ABS, ABS_MT_POSITION_Y, &y);
+
+    ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &source->uinput);
+    if (ret < 0)
+        fprintf(stderr, "Failed to create bench touchpad: %s\n", strerror(-ret));
+
+    libevdev_free(dev);
+    return ret;
+}
+
+static int bench_create_keyboard(struct bench_source *source)
+{
+    struct libevdev *dev = libevdev_new();
+    int ret;
+
+    libevdev_set_name(dev, "virtual_mk bench keyboard");
+    for (unsigned int i = 0; i < sizeof(bench_keys) / sizeof(bench_keys[0]); i++)
+        libevdev_enable_event_code(dev, EV_KEY, bench_keys[i], NULL);
+
+    ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &source->uinput);
+    if (ret < 0)
+        fprintf(stderr, "Failed to create bench keyboard: %s\n", strerror(-ret));
+
+    libevdev_free(dev);
+    return ret;
+}
+
+static void source_event(struct bench_source *source, uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event *event;
+
+    if (source->count == BENCH_MAX_EVENTS)
+        return;
+
+    event = &source->events[source->count++];
+    event->type = type;
+    event->code = code;
+    event->value = value;
+}
+
+/* One write per tick, so a burst reaches the kernel queue all at once */
+static void source_flush(struct bench_source *source)
+{
+    if (!source->count)
+        return;
+
+    if (write(libevdev_uinput_get_fd(source->uinput), source->events,
+        source->count * sizeof(struct input_event)) < 0)
+        fprintf(stderr, "Failed to write bench events: %s\n", strerror(errno));
+    else
+        source->written += source->count;
+    source->count = 0;
+}
+
+static void touch_position(struct bench_source *touchpad, int fingers, int x, int y)
+{
+    for (int slot = 0; slot < fingers; slot++) {
+        source_event(touchpad, EV_ABS, ABS_MT_SLOT, slot);
+        source_event(touchpad, EV_ABS, ABS_MT_POSITION_X, x + slot * 400);
+        source_event(touchpad, EV_ABS, ABS_MT_POSITION_Y, y);
+    }
+    source_event(touchpad, EV_ABS, ABS_X, x);
+    source_event(touchpad, EV_ABS, ABS_Y, y);
+}
+
+static void touch_down(struct bench_source *touchpad, int fingers, int x, int y)
+{
+    for (int slot = 0; slot < fingers; slot++) {
+        source_event(touchpad, EV_ABS, ABS_MT_SLOT, slot);
+        source_event(touchpad, EV_ABS, ABS_MT_TRACKING_ID, touchpad->tracking_id++ & 0xffff);
+    }
+    touch_position(touchpad, fingers, x, y);
+    source_event(touchpad, EV_KEY, BTN_TOUCH, 1);
+    source_event(touchpad, EV_KEY, fingers == 2 ? BTN_TOOL_DOUBLETAP : BTN_TOOL_FINGER, 1);
+    source_event(touchpad, EV_SYN, SYN_REPORT, 0);
+}
+
+static void touch_move(struct bench_source *touchpad, int fingers, int x, int y)
+{
+    touch_position(touchpad, fingers, x, y);
+    source_event(touchpad, EV_SYN, SYN_REPORT, 0);
+}
+
+static void touch_up(struct bench_source *touchpad, int fingers)
+{
+    for (int slot = 0; slot < fingers; slot++) {
+        source_event(touchpad, EV_ABS, ABS_MT_SLOT, slot);
+        source_event(touchpad, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    }
+    source_event(touchpad, EV_KEY, BTN_TOUCH, 0);
+    source_event(touchpad, EV_KEY, fingers == 2 ? BTN_TOOL_DOUBLETAP : BTN_TOOL_FINGER, 0);
+    source_event(touchpad, EV_SYN, SYN_REPORT, 0);
+}
+
+static void key_burst(struct bench_source *keyboard, unsigned int keys)
+{
+    for (unsigned int i = 0; i < keys; i++) {
+        uint16_t code = bench_keys[keyboard->key++ % (sizeof(bench_keys) / sizeof(bench_keys[0]))];
+
+        source_event(keyboard, EV_KEY, code, 1);
+        source_event(keyboard, EV_SYN, SYN_REPORT, 0);
+        source_event(keyboard, EV_KEY, code, 0);
+        source_event(keyboard, EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+/* One finger circling the pad, a small step per frame like a fast sensor */
+static void circle(struct bench_source *touchpad, uint64_t tick)
+{
+    int x = BENCH_CENTER_X + BENCH_RADIUS * cos(tick * 0.01);
+    int y = BENCH_CENTER_Y + BENCH_RADIUS * sin(tick * 0.01);
+
+    if (!tick)
+        touch_down(touchpad, 1, x, y);
+    else
+        touch_move(touchpad, 1, x, y);
+}
+
+static void bench_tick(struct bench *bench, uint64_t tick)
+{
+    unsigned int phase;
+
+    switch (bench->pattern)
+    {
+        case BENCH_MOTION:
+            circle(&bench->touchpad, tick);
+            break;
+
+        /* Repeated two-finger swipes, each lifting at full speed */
+        case BENCH_SCROLL:
+            phase = tick % BENCH_FLING_FRAMES;
+            if (phase == 0)
+                touch_down(&bench->touchpad, 2, BENCH_CENTER_X, 400);
+            else if (phase == BENCH_FLING_FRAMES - 1)
+                touch_up(&bench->touchpad, 2);
+            else
+                touch_move(&bench->touchpad, 2, BENCH_CENTER_X, 400 + phase * BENCH_FLING_STEP);
+            break;
+
+        case BENCH_KEYS:
+            key_burst(&bench->keyboard, bench->burst);
+            break;
+
+        case BENCH_MIXED:
+            circle(&bench->touchpad, tick);
+            if (tick % 10 == 0)
+                key_burst(&bench->keyboard, 1);
+            if (tick % 250 == 249)
+                key_burst(&bench->keyboard, bench->burst);
+            break;
+
+        default:
+            break;
+    }
+
+    source_flush(&bench->touchpad);
+    source_flush(&bench->keyboard);
+}
+
+static void *bench_generate(void *data)
+{
+    struct bench *bench = data;
+    uint64_t start_us = monotonic_us();
+    uint64_t interval_ns = bench->rate ? 1000000000ULL / bench->rate : 0;
+    struct timespec next;
+    uint64_t tick;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (tick = 0; monotonic_us() - start_us < bench->duration_us; tick++) {
+        bench_tick(bench, tick);
+
+        if (!interval_ns)
+            continue;
+
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    if (bench->pattern == BENCH_MOTION || bench->pattern == BENCH_MIXED)
+        touch_up(&bench->touchpad, 1);
+    source_flush(&bench->touchpad);
+
+    bench->ticks = tick;
+    atomic_store(&bench->done, true);
+    return NULL;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_report(struct bench *bench, struct bench_arguments *args, struct virtual_mk *v_mk,
+    struct input_device **devices, uint64_t elapsed_us, uint64_t cpu_ns)
+{
+    struct device_stats *stats[2] = { &devices[0]->mouse.stats, &devices[1]->keyboard.stats };
+    uint64_t events_in = bench->touchpad.written + bench->keyboard.written;
+    uint64_t events_out = v_mk->output->mouse_sink.events + v_mk->output->keyboard_sink.events;
+    uint64_t dropped = devices[0]->mouse.reader.resyncs + devices[1]->keyboard.reader.resyncs;
+    double rate = elapsed_us ? events_in * 1e6 / elapsed_us : 0;
+    double cpu = events_in ? (double)cpu_ns / events_in : 0;
+    bool first = true;
+
+    if (!args->json) {
+        printf("%s: %llu events in %.3fs: %.0f events/s, %.0f ns CPU per event, %llu out, %llu dropped\n",
+            pattern_names[bench->pattern], (unsigned long long)events_in, elapsed_us / 1e6, rate, cpu,
+            (unsigned long long)events_out, (unsigned long long)dropped);
+        stats_loop_report(stdout, v_mk);
+    }
+    else {
+        printf("{\"pattern\":\"%s\",\"backend\":\"%s\",\"rate\":%u,\"ticks\":%llu,\"events_in\":%llu,"
+            "\"events_out\":%llu,\"elapsed_s\":%.6f,\"events_per_s\":%.1f,\"cpu_ns_per_event\":%.1f,"
+            "\"dropped\":%llu,\"latency_us\":{",
+            pattern_names[bench->pattern], args->backend == MOUSE_BACKEND_NATIVE ? "native" : "libinput",
+            bench->rate, (unsigned long long)bench->ticks, (unsigned long long)events_in,
+            (unsigned long long)events_out, elapsed_us / 1e6, rate, cpu, (unsigned long long)dropped);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (int class = 0; class < STAT_CLASS_MAX; class++) {
+            struct latency_hist *hist = &stats[i]->latency[class];
+
+            if (!stats[i]->events[class])
+                continue;
+
+            if (!args->json) {
+                printf("  %-6s events %llu latency_us p50 %llu p99 %llu p99.9 %llu max %llu\n",
+                    stat_class_name(class), (unsigned long long)stats[i]->events[class],
+                    (unsigned long long)hist_percentile(hist, 50),
+                    (unsigned long long)hist_percentile(hist, 99),
+                    (unsigned long long)hist_percentile(hist, 99.9),
+                    (unsigned long long)hist->max);
+                continue;
+            }
+
+            printf("%s\"%s\":{\"events\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                first ? "" : ",", stat_class_name(class), (unsigned long long)stats[i]->events[class],
+                (unsigned long long)hist_percentile(hist, 50),
+                (unsigned long long)hist_percentile(hist, 99),
+                (unsigned long long)hist_percentile(hist, 99.9),
+                (unsigned long long)hist->max);
+            first = false;
+        }
+    }
+
+    if (args->json)
+        printf("}}\n");
+    fflush(stdout);
+}
+
+static int bench_run(struct bench_arguments *args, enum bench_pattern pattern, struct keymap *keymap,
+    struct chord_set *chords, struct tap_config *tap)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct input_device *devices[2];
+    struct input_handler *handler;
+    struct virtual_output output;
+    /* Grabbed throughout, so every frame is forwarded and nothing is suspended */
+    struct virtual_mk v_mk = {
+        .outputs = &output,
+        .output = &output,
+        .output_count = 1,
+        .chords = chords,
+        .keymap = keymap,
+        .tap = tap,
+        .backend = args->backend,
+        .grabbed = true,
+        .exclusive = true,
+        .epoll_fd = -1,
+        .stats_fd = -1,
+        .devices_lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    struct bench *bench;
+    pthread_t generator;
+    uint64_t start_us, last_us, start_cpu;
+    bool done;
+    int count, ret;
+
+    bench = calloc(1, sizeof(*bench));
+    if (!bench)
+        return -ENOMEM;
+
+    bench->pattern = pattern;
+    bench->rate = args->rate;
+    bench->duration_us = args->duration * 1e6;
+    bench->burst = args->burst;
+
+    ret = output_create(&output, SINK_MEMORY, 0, NULL, keymap);
+    if (ret < 0)
+        goto error_output;
+
+    v_mk.epoll_fd = epoll_create1(0);
+    if (v_mk.epoll_fd < 0) {
+        fprintf(stderr, "Failed to open epoll file descriptor: %s\n", strerror(errno));
+        ret = -errno;
+        goto error_epoll;
+    }
+
+    ret = bench_create_touchpad(&bench->touchpad);
+    if (ret < 0)
+        goto error_touchpad;
+
+    ret = bench_create_keyboard(&bench->keyboard);
+    if (ret < 0)
+        goto error_keyboard;
+
+    ret = device_add(&v_mk, DEVICE_TOUCHPAD, libevdev_uinput_get_devnode(bench->touchpad.uinput), &devices[0]);
+    if (ret < 0)
+        goto error_devices;
+
+    ret = device_add(&v_mk, DEVICE_KEYBOARD, libevdev_uinput_get_devnode(bench->keyboard.uinput), &devices[1]);
+    if (ret < 0)
+        goto error_devices;
+
+    start_us = last_us = monotonic_us();
+    start_cpu = thread_cpu_ns();
+
+    ret = -pthread_create(&generator, NULL, bench_generate, bench);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to start generator: %s\n", strerror(-ret));
+        goto error_devices;
+    }
+
+    /* Once the generator is done, a quiet wait means everything was read */
+    while (1) {
+        done = atomic_load(&bench->done);
+        count = epoll_wait(v_mk.epoll_fd, events, MAX_EPOLL_EVENTS, 50);
+        v_mk.loop_waits++;
+        if (count <= 0) {
+            if (done)
+                break;
+            continue;
+        }
+
+        for (int n = 0; n < count; n++) {
+            handler = events[n].data.ptr;
+            handler->dispatch(&v_mk, handler, events[n].events);
+        }
+        devices_reap(&v_mk);
+        last_us = monotonic_us();
+    }
+
+    pthread_join(generator, NULL);
+    bench_report(bench, args, &v_mk, devices, last_us - start_us, thread_cpu_ns() - start_cpu);
+
+error_devices:
+    devices_close(&v_mk);
+    libevdev_uinput_destroy(bench->keyboard.uinput);
+error_keyboard:
+    libevdev_uinput_destroy(bench->touchpad.uinput);
+error_touchpad:
+    close(v_mk.epoll_fd);
+error_epoll:
+    output_destroy(&output, 0);
+error_output:
+    free(bench);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_arguments args = {
+        .pattern = BENCH_PATTERN_MAX,
+        .rate = 8000,
+        .duration = 5,
+        .burst = 160,
+        .backend = MOUSE_BACKEND_NATIVE,
+        .json = false,
+    };
+    struct tap_config tap = {
+        .timeout_us = TAP_TIMEOUT_US,
+        .drag_timeout_us = TAP_DRAG_TIMEOUT_US,
+        .move_mm = TAP_MOVE_MM,
+    };
+    struct chord_set chords = {0};
+    struct keymap keymap;
+    int ret = 0;
+
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+
+    keymap_init(&keymap);
+    chord_defaults(&chords, 1);
+    accel_set(ACCEL_CURVE);
+
+    for (int pattern = 0; pattern < BENCH_PATTERN_MAX && !ret; pattern++) {
+        if (args.pattern != BENCH_PATTERN_MAX && args.pattern != pattern)
+            continue;
+        ret = bench_run(&args, pattern, &keymap, &chords, &tap);
+    }
+
+    accel_close();
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libevdev/libevdev.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+static int chord_action(const char *name, struct chord *chord)
+{
+    if (!strcmp(name, "toggle"))
+        chord->action = CHORD_TOGGLE;
+    else if (!strcmp(name, "grab"))
+        chord->action = CHORD_GRAB;
+    else if (!strcmp(name, "release"))
+        chord->action = CHORD_RELEASE;
+    else if (!strncmp(name, "target", 6) && name[6] >= '1' && name[6] <= '9' && !name[7]) {
+        chord->action = CHORD_TARGET;
+        chord->target = name[6] - '1';
+    }
+    else
+        return -EINVAL;
+
+    return 0;
+}
+
+/*
+ * Compiles "action=KEY+KEY+..." into a bitmap. A chord matches when the
+ * held keys are exactly its keys, so the press path only needs the held
+ * count and the words between first and last.
+ */
+int chord_compile(struct chord_set *set, const char *spec)
+{
+    char buf[256], *keys, *name, *save;
+    struct chord chord = {0};
+    int code;
+
+    if (set->count == CHORD_MAX) {
+        fprintf(stderr, "Too many chords, at most %d\n", CHORD_MAX);
+        return -ENOSPC;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    keys = strchr(buf, '=');
+    if (!keys) {
+        fprintf(stderr, "Chord %s is not action=KEY+KEY\n", spec);
+        return -EINVAL;
+    }
+    *keys++ = '\0';
+
+    if (chord_action(buf, &chord) < 0) {
+        fprintf(stderr, "Unknown chord action %s\n", buf);
+        return -EINVAL;
+    }
+
+    chord.first = NLONGS(KEY_CNT);
+    for (name = strtok_r(keys, "+", &save); name; name = strtok_r(NULL, "+", &save)) {
+        code = key_from_name(name);
+        if (code < 0) {
+            fprintf(stderr, "Unknown key %s in chord %s\n", name, spec);
+            return -EINVAL;
+        }
+
+        if (!bit_is_set(chord.keys, code))
+            chord.key_count++;
+        set_bit(chord.keys, code, true);
+
+        if (code / BITS_PER_LONG < chord.first)
+            chord.first = code / BITS_PER_LONG;
+        if (code / BITS_PER_LONG > chord.last)
+            chord.last = code / BITS_PER_LONG;
+    }
+
+    if (!chord.key_count) {
+        fprintf(stderr, "Chord %s has no keys\n", spec);
+        return -EINVAL;
+    }
+
+    /* QEMU's input-linux toggles its own grab on LCTRL+RCTRL */
+    chord.qemu_toggle = bit_is_set(chord.keys, KEY_LEFTCTRL) && bit_is_set(chord.keys, KEY_RIGHTCTRL);
+
+    /* A later chord with the same keys replaces the earlier one */
+    for (int i = 0; i < set->count; i++) {
+        if (!memcmp(set->chords[i].keys, chord.keys, sizeof(chord.keys))) {
+            set->chords[i] = chord;
+            return 0;
+        }
+    }
+
+    set->chords[set->count++] = chord;
+    return 0;
+}
+
+static bool chord_has_action(struct chord_set *set, enum chord_action action, int target)
+{
+    for (int i = 0; i < set->count; i++)
+        if (set->chords[i].action == action && (action != CHORD_TARGET || set->chords[i].target == target))
+            return true;
+
+    return false;
+}
+
+/* Fills in the built-in chords for actions the command line left alone */
+void chord_defaults(struct chord_set *set, int outputs)
+{
+    char spec[128];
+
+    if (!chord_has_action(set, CHORD_TOGGLE, 0) && !chord_has_action(set, CHORD_GRAB, 0)) {
+        snprintf(spec, sizeof(spec), "toggle=%s", CHORD_TOGGLE_KEYS);
+        chord_compile(set, spec);
+    }
+
+    for (int target = 0; target < outputs && outputs > 1; target++) {
+        if (chord_has_action(set, CHORD_TARGET, target))
+            continue;
+
+        snprintf(spec, sizeof(spec), "target%d=%s+%d", target + 1, CHORD_TARGET_KEYS, target + 1);
+        chord_compile(set, spec);
+    }
+}
+
+int chord_match(const struct chord_set *set, const unsigned long *key_state,
+    unsigned int keys_down, unsigned int code)
+{
+    for (int i = 0; i < set->count; i++) {
+        const struct chord *chord = &set->chords[i];
+        unsigned int word;
+
+        if (chord->key_count != keys_down || !bit_is_set(chord->keys, code))
+            continue;
+
+        for (word = chord->first; word <= chord->last; word++)
+            if ((key_state[word] & chord->keys[word]) != chord->keys[word])
+                break;
+
+        if (word > chord->last)
+            return i;
+    }
+
+    return -1;
+}
+
+bool chord_released(const struct chord *chord, const unsigned long *key_state)
+{
+    for (unsigned int word = chord->first; word <= chord->last; word++)
+        if (key_state[word] & chord->keys[word])
+            return false;
+
+    return true;
+}
@@ -1,5 +1,41 @@
-#define SCROLL_HIGH_RES (3)
-#define SCROLL (1)
+/* Finger scroll distance (libinput units) that makes one wheel detent */
+#define SCROLL_DETENT_DISTANCE (15.0)
 
-#define X_SCALE (0.5)
-#define Y_SCALE (0.5)
\ No newline at end of file
+/* Pointer acceleration curve, see accel.c; linear:0.5 is the old fixed scale */
+#define ACCEL_CURVE "linear:0.5"
+/* Event intervals are clamped to this range when estimating velocity */
+#define ACCEL_MIN_INTERVAL_US (100)
+#define ACCEL_IDLE_US (50 * 1000)
+
+/* Relative sources (mice) are copied with REL_X/REL_Y times this, 1 leaves them untouched */
+#define MOUSE_SCALE (1.0)
+
+/* Native tap-to-click: longest touch and furthest travel that still count as a tap */
+#define TAP_TIMEOUT_US (180 * 1000)
+#define TAP_MOVE_MM (1.5)
+/* A touch this soon after a tap that moves or stays down drags with BTN_LEFT held */
+#define TAP_DRAG_TIMEOUT_US (300 * 1000)
+
+/* Touchpad motion and scroll flushes per second, 0 flushes after every read */
+#define SCHEDULER_RATE (0)
+
+/* Key repeat made by --repeat's synth mode when given without values, as X's default */
+#define KEY_REPEAT_DELAY_MS (250)
+#define KEY_REPEAT_RATE (30)
+
+/* Built-in chords, the toggle matches QEMU's own grab-toggle default */
+#define CHORD_TOGGLE_KEYS "KEY_LEFTCTRL+KEY_RIGHTCTRL"
+/* Target chords are these keys plus the pair number */
+#define CHORD_TARGET_KEYS "KEY_LEFTCTRL+KEY_RIGHTCTRL"
+
+/* Virtual mouse/keyboard pairs created at startup, one per VM */
+#define OUTPUT_POOL_SIZE (1)
+
+/* Minimum time between attempts to reach a QMP socket that went away */
+#define QMP_RECONNECT_INTERVAL (500 * 1000)
+
+/* How long a running process waits for its replacement to take over before carrying on */
+#define HANDOVER_TIMEOUT_MS (5000)
+
+#define REALTIME_PRIORITY (50)
+#define REALTIME_STACK_PREFAULT (256 * 1024)
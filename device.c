@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+#include <sys/epoll.h>
+
+#include <libudev.h>
+#include <libinput.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "virtual_mk.h"
+
+static const char *kind_names[DEVICE_KIND_MAX] = {
+    [DEVICE_TOUCHPAD] = "touchpad",
+    [DEVICE_KEYBOARD] = "keyboard",
+};
+
+/* udev properties a device needs for an "auto" pattern to match it */
+static const char *kind_properties[DEVICE_KIND_MAX] = {
+    [DEVICE_TOUCHPAD] = "ID_INPUT_TOUCHPAD",
+    [DEVICE_KEYBOARD] = "ID_INPUT_KEYBOARD",
+};
+
+void handler_add(struct virtual_mk *v_mk, struct input_handler *handler)
+{
+    struct epoll_event epoll_event = {
+        .events = handler->events ? handler->events : EPOLLIN,
+        .data.ptr = handler,
+    };
+
+    if (v_mk->uring) {
+        uring_add(v_mk->uring, handler);
+        return;
+    }
+
+    if (v_mk->epoll_fd < 0)
+        return;
+
+    if (epoll_ctl(v_mk->epoll_fd, EPOLL_CTL_ADD, handler->fd, &epoll_event) < 0)
+        fprintf(stderr, "Failed to watch fd %d: %s\n", handler->fd, strerror(errno));
+}
+
+void handler_remove(struct virtual_mk *v_mk, struct input_handler *handler)
+{
+    if (v_mk->uring)
+        uring_remove(v_mk->uring, handler);
+    else if (v_mk->epoll_fd >= 0)
+        epoll_ctl(v_mk->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+/* io_uring has no poll mask to change in place here, the poll is cancelled and armed again */
+void handler_modify(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct epoll_event epoll_event = {
+        .events = events,
+        .data.ptr = handler,
+    };
+
+    handler->events = events;
+
+    if (v_mk->uring) {
+        uring_remove(v_mk->uring, handler);
+        uring_add(v_mk->uring, handler);
+        return;
+    }
+
+    if (v_mk->epoll_fd < 0)
+        return;
+
+    if (epoll_ctl(v_mk->epoll_fd, EPOLL_CTL_MOD, handler->fd, &epoll_event) < 0)
+        fprintf(stderr, "Failed to change watch on fd %d: %s\n", handler->fd, strerror(errno));
+}
+
+static void dispatch_touchpad(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct input_device *device = container_of(handler, struct input_device, handler);
+    struct virtual_mouse *mouse = &device->mouse;
+
+    if (device->removed)
+        return;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        device_remove(v_mk, device);
+        return;
+    }
+
+    if (mouse->backend == MOUSE_BACKEND_LIBINPUT) {
+        TRACE(libinput_dispatch_start, handler->fd);
+        libinput_dispatch(mouse->libinput_context);
+        TRACE(libinput_dispatch_end, handler->fd);
+    }
+    mouse_handle_events(mouse);
+}
+
+static void dispatch_keyboard(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct input_device *device = container_of(handler, struct input_device, handler);
+    struct virtual_keyboard *keyboard = &device->keyboard;
+
+    if (device->removed)
+        return;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        device_remove(v_mk, device);
+        return;
+    }
+
+    keyboard_handle_events(keyboard);
+
+    if (keyboard->switch_target >= 0) {
+        devices_set_target(v_mk, keyboard->switch_target);
+        keyboard->switch_target = -1;
+    }
+
+    /* A grab chord on any keyboard moves every source device with it */
+    if (keyboard->grabbed != v_mk->grabbed)
+        devices_set_grab(v_mk, keyboard->grabbed);
+}
+
+/* A suspended raw touchpad has nothing to read, libinput's fd goes quiet by itself */
+bool device_idle(const struct input_device *device)
+{
+    return device->kind == DEVICE_TOUCHPAD && device->mouse.suspended &&
+        device->mouse.backend != MOUSE_BACKEND_LIBINPUT;
+}
+
+/* Passthrough touchpads write to their own clone on each pair */
+static struct output_sink *device_mouse_sink(struct virtual_mk *v_mk, struct input_device *device,
+    struct virtual_output *output)
+{
+    if (device->mouse.backend == MOUSE_BACKEND_PASSTHROUGH)
+        return &device->mouse.passthrough_sinks[output - v_mk->outputs];
+
+    return &output->mouse_sink;
+}
+
+/* A keyboard's repeat timer under --repeat synth */
+static void dispatch_repeat(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct input_device *device = container_of(handler, struct input_device, repeat_handler);
+
+    if (!device->removed)
+        keyboard_repeat(&device->keyboard);
+}
+
+/* Keeps idle devices off the event loop; a reader thread leaves its fd out of its own poll */
+static void device_watch(struct virtual_mk *v_mk, struct input_device *device)
+{
+    bool watch = !device_idle(device);
+
+    if (device->thread || device->watched == watch)
+        return;
+
+    if (watch)
+        handler_add(v_mk, &device->handler);
+    else
+        handler_remove(v_mk, &device->handler);
+    device->watched = watch;
+}
+
+/*
+ * Brings one device in line with the wanted grab state and output pair:
+ * held keys and buttons are released on the old pair before the sink
+ * moves. Threaded devices only run this on their own thread.
+ */
+void device_sync(struct virtual_mk *v_mk, struct input_device *device)
+{
+    struct virtual_output *output = v_mk->output;
+    bool grab = v_mk->grabbed;
+
+    if (device->kind == DEVICE_KEYBOARD) {
+        struct virtual_keyboard *keyboard = &device->keyboard;
+
+        if (device->output != output) {
+            keyboard_release_keys(keyboard);
+            device->output = output;
+            if (!device->thread)
+                keyboard->frame.sink = &output->keyboard_sink;
+        }
+
+        if (keyboard->grabbed != grab) {
+            keyboard->grabbed = grab;
+            keyboard_grab_global(keyboard, grab);
+        }
+    }
+    else {
+        struct virtual_mouse *mouse = &device->mouse;
+
+        if (device->output != output) {
+            mouse_release_buttons(mouse);
+            device->output = output;
+            if (!device->thread)
+                mouse->frame.sink = device_mouse_sink(v_mk, device, output);
+        }
+
+        if (mouse->grabbed != grab) {
+            mouse_grab_global(mouse, grab);
+            device_watch(v_mk, device);
+        }
+    }
+}
+
+/* Called from any reader thread; the list lock keeps hotplug from freeing a device under us */
+static void devices_sync(struct virtual_mk *v_mk)
+{
+    pthread_mutex_lock(&v_mk->devices_lock);
+    for (struct input_device *device = v_mk->devices; device; device = device->next) {
+        if (device->removed)
+            continue;
+
+        if (device->thread)
+            thread_wake(device->thread);
+        else
+            device_sync(v_mk, device);
+    }
+    pthread_mutex_unlock(&v_mk->devices_lock);
+}
+
+void devices_set_grab(struct virtual_mk *v_mk, bool grab)
+{
+    // printf("%s\n", grab ? "Grab" : "Ungrab");
+    TRACE(grab, grab);
+    v_mk->grabbed = grab;
+    devices_sync(v_mk);
+}
+
+/*
+ * Moves every source device to another output pair. The pairs already
+ * exist, so this only releases what is held on the old pair and swaps
+ * each frame's sink pointer.
+ */
+void devices_set_target(struct virtual_mk *v_mk, int index)
+{
+    if (index >= v_mk->output_count || &v_mk->outputs[index] == v_mk->output)
+        return;
+
+    v_mk->output = &v_mk->outputs[index];
+    TRACE(target, index);
+    printf("Switched to output %d\n", index + 1);
+    devices_sync(v_mk);
+}
+
+static struct input_device *device_find(struct virtual_mk *v_mk, const char *devnode)
+{
+    for (struct input_device *device = v_mk->devices; device; device = device->next)
+        if (!device->removed && !strcmp(device->devnode, devnode))
+            return device;
+
+    return NULL;
+}
+
+/* Our own uinput devices must never be picked up as sources */
+static bool devnode_is(struct libevdev_uinput *uinput, const char *devnode)
+{
+    const char *node = uinput ? libevdev_uinput_get_devnode(uinput) : NULL;
+
+    return node && !strcmp(node, devnode);
+}
+
+static bool device_is_ours(struct virtual_mk *v_mk, const char *devnode)
+{
+    for (int i = 0; i < v_mk->output_count; i++)
+        if (!strcmp(v_mk->outputs[i].mouse_devnode, devnode) ||
+            !strcmp(v_mk->outputs[i].keyboard_devnode, devnode))
+            return true;
+
+    for (struct input_device *device = v_mk->devices; device; device = device->next)
+        for (int i = 0; device->kind == DEVICE_TOUCHPAD && i < device->mouse.passthrough_count; i++)
+            if (devnode_is(device->mouse.passthrough[i], devnode))
+                return true;
+
+    return v_mk->recorder && devnode_is(v_mk->recorder->clone, devnode);
+}
+
+int device_add(struct virtual_mk *v_mk, enum device_kind kind, const char *devnode,
+    struct input_device **out)
+{
+    struct input_device *device;
+    int ret;
+
+    device = calloc(1, sizeof(*device));
+    if (!device)
+        return -ENOMEM;
+
+    device->kind = kind;
+    device->output = v_mk->output;
+    snprintf(device->devnode, sizeof(device->devnode), "%s", devnode);
+    snprintf(device->name, sizeof(device->name), "%s %s", kind_names[kind], devnode);
+
+    if (kind == DEVICE_TOUCHPAD) {
+        struct virtual_mouse *mouse = &device->mouse;
+
+        mouse->backend = v_mk->backend;
+        mouse->fd = mouse->libinput_fd = mouse->evdev_fd = -1;
+        mouse->exclusive = v_mk->exclusive;
+        mouse->tap = v_mk->tap;
+        mouse->rel_scale = v_mk->mouse_scale;
+        mouse->scheduler = v_mk->scheduler.rate ? &v_mk->scheduler : NULL;
+        ret = mouse_create(devnode, mouse, &device->output->mouse_sink);
+        if (ret < 0)
+            goto error;
+
+        if (mouse->backend == MOUSE_BACKEND_PASSTHROUGH) {
+            ret = touchpad_passthrough_create(mouse, v_mk->outputs, v_mk->output_count);
+            if (ret < 0) {
+                mouse_close(mouse);
+                goto error;
+            }
+            mouse->frame.sink = device_mouse_sink(v_mk, device, device->output);
+        }
+
+        mouse->stats.name = device->name;
+        device->handler.fd = mouse->fd;
+        device->handler.dispatch = dispatch_touchpad;
+        /* libinput reads its own fd, only the raw backends can be fed */
+        if (mouse->backend != MOUSE_BACKEND_LIBINPUT)
+            device->handler.reader = &mouse->reader;
+        /*
+         * Starts idle, device_sync resumes it when we hold the grab. Already
+         * grabbed it stays open: a handed over fd carries the grab, a reopen
+         * would not get it back.
+         */
+        if (!v_mk->grabbed)
+            mouse_suspend(mouse);
+    }
+    else {
+        struct virtual_keyboard *keyboard = &device->keyboard;
+
+        keyboard->fd = -1;
+        keyboard->exclusive = v_mk->exclusive;
+        keyboard->recorder = v_mk->recorder;
+        keyboard->chords = v_mk->chords;
+        keyboard->keymap = v_mk->keymap;
+        keyboard->repeat = &v_mk->repeat;
+        keyboard->toggle_qemu = device->output->keyboard_sink.type != SINK_QMP;
+        ret = keyboard_create(devnode, keyboard, &device->output->keyboard_sink);
+        if (ret < 0)
+            goto error;
+
+        /* Made repeats come from the main loop, --repeat synth and --threads do not mix */
+        if (keyboard->repeat_fd >= 0) {
+            device->repeat_handler.fd = keyboard->repeat_fd;
+            device->repeat_handler.dispatch = dispatch_repeat;
+            handler_add(v_mk, &device->repeat_handler);
+        }
+
+        keyboard->stats.name = device->name;
+        device->handler.fd = keyboard->fd;
+        device->handler.dispatch = dispatch_keyboard;
+        device->handler.reader = &keyboard->reader;
+    }
+
+    /* A thread applies the grab state itself, one that fails to start leaves the device on the event loop */
+    if (!v_mk->threads || thread_start(v_mk, device) < 0) {
+        device_sync(v_mk, device);
+        device_watch(v_mk, device);
+    }
+
+    pthread_mutex_lock(&v_mk->devices_lock);
+    device->next = v_mk->devices;
+    v_mk->devices = device;
+    pthread_mutex_unlock(&v_mk->devices_lock);
+    printf("Added %s\n", device->name);
+
+    if (out)
+        *out = device;
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to add %s %s: %s\n", kind_names[kind], devnode, strerror(-ret));
+    free(device);
+    return ret;
+}
+
+/*
+ * Takes the device out of the event loop right away; the memory is only
+ * released by devices_reap, as later events of the same batch may still
+ * point at it.
+ */
+void device_remove(struct virtual_mk *v_mk, struct input_device *device)
+{
+    if (device->removed)
+        return;
+
+    /* Under the list lock, so a reader thread walking it never wakes a thread being freed */
+    pthread_mutex_lock(&v_mk->devices_lock);
+    device->removed = true;
+    pthread_mutex_unlock(&v_mk->devices_lock);
+
+    if (device->thread)
+        thread_stop(v_mk, device);
+    else if (device->watched)
+        handler_remove(v_mk, &device->handler);
+
+    if (device->kind == DEVICE_KEYBOARD) {
+        if (device->keyboard.repeat_fd >= 0)
+            handler_remove(v_mk, &device->repeat_handler);
+        keyboard_release_keys(&device->keyboard);
+        keyboard_close(&device->keyboard);
+    }
+    else {
+        mouse_release_buttons(&device->mouse);
+        mouse_close(&device->mouse);
+    }
+
+    printf("Removed %s\n", device->name);
+    v_mk->reap = true;
+}
+
+void devices_reap(struct virtual_mk *v_mk)
+{
+    struct input_device **link = &v_mk->devices;
+
+    if (!v_mk->reap)
+        return;
+
+    pthread_mutex_lock(&v_mk->devices_lock);
+    while (*link) {
+        struct input_device *device = *link;
+
+        if (device->removed) {
+            *link = device->next;
+            free(device);
+        }
+        else {
+            link = &device->next;
+        }
+    }
+    pthread_mutex_unlock(&v_mk->devices_lock);
+    v_mk->reap = false;
+}
+
+void devices_close(struct virtual_mk *v_mk)
+{
+    for (struct input_device *device = v_mk->devices; device; device = device->next) {
+        if (device->kind == DEVICE_KEYBOARD) {
+            frame_report(device->name, &device->keyboard.frame);
+            keyboard_report(stdout, &device->keyboard);
+        }
+        else
+            frame_report(device->name, &device->mouse.frame);
+        device_remove(v_mk, device);
+    }
+    devices_reap(v_mk);
+}
+
+static bool pattern_matches(const char *pattern, const char *resolved, const char *devnode, const char *links)
+{
+    char link[PATH_MAX];
+    const char *start, *end;
+
+    if (!fnmatch(pattern, devnode, 0))
+        return true;
+
+    if (resolved && !strcmp(resolved, devnode))
+        return true;
+
+    /* DEVLINKS is a space separated list of the node's symlinks */
+    for (start = links; start && *start; start = end) {
+        end = strchrnul(start, ' ');
+        if ((size_t)(end - start) < sizeof(link)) {
+            memcpy(link, start, end - start);
+            link[end - start] = '\0';
+            if (!fnmatch(pattern, link, 0))
+                return true;
+        }
+        while (*end == ' ')
+            end++;
+    }
+
+    return false;
+}
+
+static bool device_matches(struct virtual_mk *v_mk, enum device_kind kind, const char *devnode,
+    struct udev_device *udev_device)
+{
+    struct device_match *match = &v_mk->matches[kind];
+    const char *links = udev_device_get_property_value(udev_device, "DEVLINKS");
+    const char *capability;
+
+    for (int i = 0; i < match->count; i++) {
+        if (!strcmp(match->patterns[i], "auto")) {
+            capability = udev_device_get_property_value(udev_device, kind_properties[kind]);
+            if (capability && !strcmp(capability, "1"))
+                return true;
+            continue;
+        }
+
+        if (pattern_matches(match->patterns[i], match->resolved[i], devnode, links))
+            return true;
+    }
+
+    return false;
+}
+
+static void device_probe(struct virtual_mk *v_mk, struct udev_device *udev_device)
+{
+    const char *devnode = udev_device_get_devnode(udev_device);
+
+    if (!devnode || strncmp(devnode, "/dev/input/event", 16))
+        return;
+
+    if (device_find(v_mk, devnode) || device_is_ours(v_mk, devnode))
+        return;
+
+    for (int kind = 0; kind < DEVICE_KIND_MAX; kind++) {
+        if (device_matches(v_mk, kind, devnode, udev_device)) {
+            device_add(v_mk, kind, devnode, NULL);
+            return;
+        }
+    }
+}
+
+static void dispatch_hotplug(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct udev_device *udev_device;
+    struct input_device *device;
+    const char *action, *devnode;
+
+    while ((udev_device = udev_monitor_receive_device(v_mk->monitor)) != NULL) {
+        action = udev_device_get_action(udev_device);
+        devnode = udev_device_get_devnode(udev_device);
+
+        if (action && devnode) {
+            if (!strcmp(action, "add")) {
+                device_probe(v_mk, udev_device);
+            }
+            else if (!strcmp(action, "remove")) {
+                device = device_find(v_mk, devnode);
+                if (device)
+                    device_remove(v_mk, device);
+            }
+        }
+        udev_device_unref(udev_device);
+    }
+}
+
+/*
+ * Starts listening for udev input events first, then adds the devices
+ * that already exist, so nothing plugged in between is missed.
+ */
+int hotplug_init(struct virtual_mk *v_mk)
+{
+    struct udev_enumerate *enumerate;
+    struct udev_list_entry *entry;
+    struct udev_device *udev_device;
+
+    for (int kind = 0; kind < DEVICE_KIND_MAX; kind++) {
+        struct device_match *match = &v_mk->matches[kind];
+
+        for (int i = 0; i < match->count; i++)
+            match->resolved[i] = realpath(match->patterns[i], NULL);
+    }
+
+    v_mk->udev = udev_new();
+    if (!v_mk->udev) {
+        fprintf(stderr, "Failed to create udev context\n");
+        return -ENOMEM;
+    }
+
+    v_mk->monitor = udev_monitor_new_from_netlink(v_mk->udev, "udev");
+    if (!v_mk->monitor) {
+        fprintf(stderr, "Failed to create udev monitor\n");
+        udev_unref(v_mk->udev);
+        return -ENOMEM;
+    }
+    udev_monitor_filter_add_match_subsystem_devtype(v_mk->monitor, "input", NULL);
+    udev_monitor_enable_receiving(v_mk->monitor);
+
+    v_mk->monitor_handler.fd = udev_monitor_get_fd(v_mk->monitor);
+    v_mk->monitor_handler.dispatch = dispatch_hotplug;
+    handler_add(v_mk, &v_mk->monitor_handler);
+
+    enumerate = udev_enumerate_new(v_mk->udev);
+    udev_enumerate_add_match_subsystem(enumerate, "input");
+    udev_enumerate_scan_devices(enumerate);
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        udev_device = udev_device_new_from_syspath(v_mk->udev, udev_list_entry_get_name(entry));
+        if (!udev_device)
+            continue;
+        device_probe(v_mk, udev_device);
+        udev_device_unref(udev_device);
+    }
+    udev_enumerate_unref(enumerate);
+
+    return 0;
+}
+
+void hotplug_close(struct virtual_mk *v_mk)
+{
+    for (int kind = 0; kind < DEVICE_KIND_MAX; kind++) {
+        struct device_match *match = &v_mk->matches[kind];
+
+        for (int i = 0; i < match->count; i++) {
+            free(match->resolved[i]);
+            match->resolved[i] = NULL;
+        }
+    }
+
+    if (v_mk->monitor)
+        udev_monitor_unref(v_mk->monitor);
+    if (v_mk->udev)
+        udev_unref(v_mk->udev);
+}
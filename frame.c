@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "virtual_mk.h"
+
+static int sink_uinput_write(struct output_sink *sink, const struct input_event *events, unsigned int count)
+{
+    ssize_t ret;
+
+    sink->frames++;
+    /* Never a write() next to the ring's writes, it could pass frames still queued there */
+    if (sink->uring) {
+        ret = uring_write(sink->uring, sink, events, count);
+        if (ret < 0)
+            return ret;
+        sink->events += count;
+        return 0;
+    }
+
+    /* uinput accepts any number of whole input_events per write() */
+    sink->syscalls++;
+    do {
+        ret = write(sink->fd, events, count * sizeof(struct input_event));
+    } while (ret < 0 && errno == EINTR);
+    TRACE(uinput_write, sink->fd, ret);
+
+    if (ret < 0)
+        return -errno;
+
+    sink->events += count;
+    return 0;
+}
+
+/* FNV-1a over type/code/value, timestamps are left out so runs compare */
+static int sink_memory_write(struct output_sink *sink, const struct input_event *events, unsigned int count)
+{
+    uint64_t hash = sink->hash;
+
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t words[3] = { events[i].type, events[i].code, (uint32_t)events[i].value };
+        const uint8_t *bytes = (const uint8_t *)words;
+
+        for (unsigned int j = 0; j < sizeof(words); j++) {
+            hash ^= bytes[j];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    sink->hash = hash;
+    sink->events += count;
+    return 0;
+}
+
+void sink_init(struct output_sink *sink, enum sink_type type, int fd)
+{
+    sink->type = type;
+    sink->fd = fd;
+    sink->qmp = NULL;
+    sink->uring = NULL;
+    sink->frames = 0;
+    sink->syscalls = 0;
+    sink->events = 0;
+    sink->hash = 0xcbf29ce484222325ULL;
+
+    switch (type)
+    {
+        case SINK_MEMORY:
+            sink->write = sink_memory_write;
+            break;
+
+        case SINK_QMP:
+            sink->write = sink_qmp_write;
+            break;
+
+        case SINK_RING:
+            sink->write = sink_ring_write;
+            break;
+
+        case SINK_UINPUT:
+        default:
+            sink->write = sink_uinput_write;
+            break;
+    }
+}
+
+void sink_report(const char *name, struct output_sink *sink)
+{
+    if (sink->type == SINK_MEMORY)
+        printf("%s: %llu events, hash %016llx\n", name,
+            (unsigned long long)sink->events, (unsigned long long)sink->hash);
+}
+
+void frame_init(struct output_frame *frame, struct output_sink *sink, struct device_stats *stats)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->sink = sink;
+    frame->stats = stats;
+}
+
+/* Stops the clock on each marked event, right after the write that carried it */
+void frame_record_samples(struct device_stats *stats, const struct frame_sample *samples, unsigned int count)
+{
+    uint64_t now = monotonic_us();
+
+    for (unsigned int i = 0; i < count; i++)
+        hist_add(&stats->latency[samples[i].class], now > samples[i].time_us ? now - samples[i].time_us : 0);
+}
+
+static void frame_record_latency(struct output_frame *frame)
+{
+    frame_record_samples(frame->stats, frame->samples, frame->sample_count);
+    frame->sample_count = 0;
+}
+
+static int frame_send(struct output_frame *frame, const struct input_event *events, unsigned int count)
+{
+    int ret;
+
+    TRACE(frame_out, frame->stats ? frame->stats->name : NULL, count);
+    ret = frame->sink->write(frame->sink, events, count);
+
+    /* Memory, qmp and ring sinks make no syscall per frame, there is nothing to save */
+    if (frame->sink->type == SINK_UINPUT) {
+        frame->syscalls++;
+        frame->syscalls_saved += count - 1;
+    }
+    frame->events_written += count;
+
+    if (frame->sample_count)
+        frame_record_latency(frame);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write frame: %s\n", strerror(-ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+int frame_flush(struct output_frame *frame)
+{
+    unsigned int count = frame->count;
+
+    if (!count)
+        return 0;
+
+    frame->count = 0;
+    return frame_send(frame, frame->events, count);
+}
+
+/*
+ * Whole frames written from where they lie, after anything already queued.
+ * A run longer than a frame goes out in frame sized writes: the ring and
+ * io_uring copy each write into a slot of that size.
+ */
+int frame_pass(struct output_frame *frame, const struct input_event *events, unsigned int count)
+{
+    unsigned int chunk;
+    int ret = 0;
+
+    if (!count)
+        return 0;
+
+    frame_flush(frame);
+    for (; count && ret == 0; events += chunk, count -= chunk) {
+        chunk = count < FRAME_MAX_EVENTS ? count : FRAME_MAX_EVENTS;
+        ret = frame_send(frame, events, chunk);
+    }
+
+    return ret;
+}
+
+void frame_report(const char *name, struct output_frame *frame)
+{
+    if (!frame->syscalls) {
+        printf("%s: %llu events\n", name, (unsigned long long)frame->events_written);
+        return;
+    }
+
+    printf("%s: %llu events in %llu writes (%llu syscalls saved)\n", name,
+        (unsigned long long)frame->events_written,
+        (unsigned long long)frame->syscalls,
+        (unsigned long long)frame->syscalls_saved);
+}
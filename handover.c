@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+/*
+ * One SOCK_SEQPACKET message from the running process to its replacement.
+ * The fds ride along as SCM_RIGHTS in the same order: mouse and keyboard
+ * of each pair, then one per source device. Both sides run the same
+ * build, so the layout is native and only the version is checked.
+ */
+struct handover_message {
+    char magic[4];
+    uint32_t version;
+    uint32_t grabbed;
+    uint32_t output;
+    uint32_t output_count;
+    uint32_t device_count;
+    char mouse_devnodes[OUTPUT_POOL_MAX][DEVICE_NAME_SIZE];
+    char keyboard_devnodes[OUTPUT_POOL_MAX][DEVICE_NAME_SIZE];
+    char devnodes[HANDOVER_DEVICES_MAX][DEVICE_NAME_SIZE];
+};
+
+#define HANDOVER_FDS_MAX (OUTPUT_POOL_MAX * 2 + HANDOVER_DEVICES_MAX)
+#define HANDOVER_ACK 1
+
+union handover_control {
+    char buf[CMSG_SPACE(HANDOVER_FDS_MAX * sizeof(int))];
+    struct cmsghdr align;
+};
+
+/* Source device fds handed over, claimed by handover_open as the devices come back */
+static struct {
+    char devnode[DEVICE_NAME_SIZE];
+    int fd;
+} inherited[HANDOVER_DEVICES_MAX];
+static int inherited_count;
+
+static int handover_address(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Handover socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int handover_send(struct virtual_mk *v_mk, int fd)
+{
+    struct handover_message message = {0};
+    union handover_control control;
+    int fds[HANDOVER_FDS_MAX];
+    struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int count = 0;
+
+    memcpy(message.magic, HANDOVER_MAGIC, sizeof(message.magic));
+    message.version = HANDOVER_VERSION;
+    message.grabbed = v_mk->grabbed;
+    message.output = v_mk->output - v_mk->outputs;
+
+    /* Memory and qmp pairs have no devices of their own, the replacement makes those anew */
+    for (int i = 0; i < v_mk->output_count; i++) {
+        struct virtual_output *output = &v_mk->outputs[i];
+
+        if (output->mouse_sink.type != SINK_UINPUT)
+            break;
+
+        snprintf(message.mouse_devnodes[i], DEVICE_NAME_SIZE, "%s", output->mouse_devnode);
+        snprintf(message.keyboard_devnodes[i], DEVICE_NAME_SIZE, "%s", output->keyboard_devnode);
+        fds[count++] = output->mouse_sink.fd;
+        fds[count++] = output->keyboard_sink.fd;
+        message.output_count++;
+    }
+
+    /* A suspended libinput touchpad has nothing open, the replacement opens it itself */
+    for (struct input_device *device = v_mk->devices; device; device = device->next) {
+        int device_fd = device->kind == DEVICE_KEYBOARD ? device->keyboard.fd : device->mouse.evdev_fd;
+
+        if (device->removed || device_fd < 0 || message.device_count == HANDOVER_DEVICES_MAX)
+            continue;
+
+        snprintf(message.devnodes[message.device_count++], DEVICE_NAME_SIZE, "%s", device->devnode);
+        fds[count++] = device_fd;
+    }
+
+    if (count) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "Failed to send handover: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * The old process stops reading while it waits for the reply. Events keep
+ * queueing in the kernel on the shared fds, so whichever process ends up
+ * with the devices reads them and nothing is lost to the other one.
+ */
+static void dispatch_handover(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct timeval timeout = {
+        .tv_sec = HANDOVER_TIMEOUT_MS / 1000,
+        .tv_usec = (HANDOVER_TIMEOUT_MS % 1000) * 1000,
+    };
+    char ack = 0;
+    int fd;
+
+    fd = accept4(handler->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (handover_send(v_mk, fd) < 0 || recv(fd, &ack, 1, 0) != 1 || ack != HANDOVER_ACK) {
+        fprintf(stderr, "Handover not taken up, carrying on\n");
+        close(fd);
+        return;
+    }
+
+    printf("Handed over to the new process\n");
+    stats_loop_report(stdout, v_mk);
+    /* No cleanup, destroying the pairs or releasing the grabs would undo the handover */
+    exit(EXIT_SUCCESS);
+}
+
+/* Returns 1 with the state filled in, 0 when nothing is running at path */
+int handover_receive(const char *path, struct handover *handover)
+{
+    struct sockaddr_un addr = {0};
+    struct handover_message message;
+    union handover_control control;
+    struct iovec iov = { .iov_base = &message, .iov_len = sizeof(message) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct timeval timeout = {
+        .tv_sec = HANDOVER_TIMEOUT_MS / 1000,
+        .tv_usec = (HANDOVER_TIMEOUT_MS % 1000) * 1000,
+    };
+    struct cmsghdr *cmsg;
+    int fds[HANDOVER_FDS_MAX];
+    int fd, count = 0, ret;
+    ssize_t len;
+
+    handover->fd = -1;
+    handover->output_count = 0;
+
+    ret = handover_address(&addr, path);
+    if (ret < 0)
+        return ret;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open handover socket: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ret = -errno;
+        close(fd);
+        /* Nobody to take over from, a plain start */
+        if (ret == -ENOENT || ret == -ECONNREFUSED)
+            return 0;
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(-ret));
+        return ret;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        ret = -errno;
+        fprintf(stderr, "Failed to receive handover: %s\n", strerror(errno));
+        goto error;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+
+    if (len != sizeof(message) || memcmp(message.magic, HANDOVER_MAGIC, sizeof(message.magic)) ||
+        message.version != HANDOVER_VERSION || (msg.msg_flags & MSG_CTRUNC) ||
+        message.output >= OUTPUT_POOL_MAX || message.output_count > OUTPUT_POOL_MAX ||
+        message.device_count > HANDOVER_DEVICES_MAX ||
+        (unsigned int)count != message.output_count * 2 + message.device_count) {
+        fprintf(stderr, "Invalid handover from %s\n", path);
+        ret = -EPROTO;
+        goto error_fds;
+    }
+
+    handover->grabbed = message.grabbed;
+    handover->output = message.output;
+    handover->output_count = message.output_count;
+    for (int i = 0; i < handover->output_count; i++) {
+        handover->mouse_fds[i] = fds[i * 2];
+        handover->keyboard_fds[i] = fds[i * 2 + 1];
+        snprintf(handover->mouse_devnodes[i], DEVICE_NAME_SIZE, "%.*s",
+            DEVICE_NAME_SIZE - 1, message.mouse_devnodes[i]);
+        snprintf(handover->keyboard_devnodes[i], DEVICE_NAME_SIZE, "%.*s",
+            DEVICE_NAME_SIZE - 1, message.keyboard_devnodes[i]);
+    }
+
+    inherited_count = message.device_count;
+    for (int i = 0; i < inherited_count; i++) {
+        inherited[i].fd = fds[message.output_count * 2 + i];
+        snprintf(inherited[i].devnode, DEVICE_NAME_SIZE, "%.*s",
+            DEVICE_NAME_SIZE - 1, message.devnodes[i]);
+    }
+
+    handover->fd = fd;
+    printf("Taking over %d output pairs and %d devices from %s, %s\n", handover->output_count,
+        inherited_count, path, handover->grabbed ? "grabbed" : "ungrabbed");
+    return 1;
+
+error_fds:
+    for (int i = 0; i < count; i++)
+        close(fds[i]);
+error:
+    close(fd);
+    return ret;
+}
+
+/* Source devices reuse a handed over fd, which keeps its grab and queued events */
+int handover_open(const char *path, int flags)
+{
+    int fd;
+
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited[i].fd < 0 || strcmp(inherited[i].devnode, path))
+            continue;
+
+        fd = inherited[i].fd;
+        inherited[i].fd = -1;
+        return fd;
+    }
+
+    return open(path, flags);
+}
+
+/*
+ * Called once every device is back. After the ack the old process exits
+ * without destroying anything, so the pairs are ours from here on. Fds
+ * nobody claimed, e.g. a device unplugged meanwhile, are let go.
+ *
+ * Without the ack the old process may have timed out and carried on with
+ * the same fds, and two processes would split the input. The error makes
+ * the caller close everything it inherited and exit, the pairs stay
+ * borrowed so nothing is destroyed under the old process.
+ */
+int handover_finish(struct handover *handover, struct virtual_mk *v_mk)
+{
+    char ack = HANDOVER_ACK;
+    int ret = 0;
+
+    if (handover->fd < 0)
+        return 0;
+
+    if (send(handover->fd, &ack, 1, MSG_NOSIGNAL) == 1) {
+        for (int i = 0; i < v_mk->output_count; i++)
+            v_mk->outputs[i].borrowed = false;
+    }
+    else {
+        ret = -errno;
+        fprintf(stderr, "Failed to complete handover, leaving the devices to the old process: %s\n",
+            strerror(errno));
+    }
+
+    close(handover->fd);
+    handover->fd = -1;
+
+    for (int i = 0; i < handover->output_count; i++) {
+        if (handover->mouse_fds[i] >= 0)
+            close(handover->mouse_fds[i]);
+        if (handover->keyboard_fds[i] >= 0)
+            close(handover->keyboard_fds[i]);
+    }
+
+    for (int i = 0; i < inherited_count; i++)
+        if (inherited[i].fd >= 0)
+            close(inherited[i].fd);
+    inherited_count = 0;
+
+    return ret;
+}
+
+int handover_listen(struct virtual_mk *v_mk, const char *path)
+{
+    struct sockaddr_un addr = {0};
+    int fd, ret;
+
+    ret = handover_address(&addr, path);
+    if (ret < 0)
+        return ret;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open handover socket: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    /* The path may still be the old process's socket, it keeps its connection */
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+
+    v_mk->handover_fd = fd;
+    v_mk->handover_path = path;
+    v_mk->handover_handler.fd = fd;
+    v_mk->handover_handler.dispatch = dispatch_handover;
+    handler_add(v_mk, &v_mk->handover_handler);
+
+    return 0;
+}
+
+void handover_close(struct virtual_mk *v_mk)
+{
+    if (v_mk->handover_fd < 0)
+        return;
+
+    close(v_mk->handover_fd);
+    unlink(v_mk->handover_path);
+}
@@ -4,120 +4,235 @@
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
 #include "virtual_mk.h"
 
-#define MAX_EVENTS 16
-
 #define toggle_grab(keyboard) ({ \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_KEY, KEY_LEFTCTRL, 1); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_SYN, SYN_REPORT, 0); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_KEY, KEY_RIGHTCTRL, 1); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_SYN, SYN_REPORT, 0); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_KEY, KEY_RIGHTCTRL, 0); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_SYN, SYN_REPORT, 0); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_KEY, KEY_LEFTCTRL, 0); \
-    libevdev_uinput_write_event((keyboard)->output_device, EV_SYN, SYN_REPORT, 0); \
+    frame_write(&(keyboard)->frame, EV_KEY, KEY_LEFTCTRL, 1); \
+    frame_sync(&(keyboard)->frame); \
+    frame_write(&(keyboard)->frame, EV_KEY, KEY_RIGHTCTRL, 1); \
+    frame_sync(&(keyboard)->frame); \
+    frame_write(&(keyboard)->frame, EV_KEY, KEY_RIGHTCTRL, 0); \
+    frame_sync(&(keyboard)->frame); \
+    frame_write(&(keyboard)->frame, EV_KEY, KEY_LEFTCTRL, 0); \
+    frame_sync(&(keyboard)->frame); \
 })
 
-static struct grab_context {
-    bool left_ctrl;
-    bool right_ctrl;
-    bool grab;
-    unsigned int count;
-} grab = {
-    .left_ctrl = 0,
-    .right_ctrl = 0,
-    .grab = 0,
-    .count = 0,
-};
-
-static void inline __keyboard_grab(struct virtual_keyboard *keyboard, struct input_event *event)
-{
-    if (grab.left_ctrl && grab.right_ctrl) {
-        /* LCTRL(Down: 1) -> RCTRL(Down: 2) */
-        if (grab.count == 1)
-            if (keyboard->grabbed)
-                grab.grab = 0;
-            else
-                grab.grab = 1;
-    }
-    else if (!grab.left_ctrl && !grab.right_ctrl) {
-        /* LCTRL(Down: 1) -> RCTRL(Down: 2) -> RCTRL(Up: 3) -> LCTRL(Up: 4) */
-        if (grab.count == 3) {
-            if (grab.grab) {
-                keyboard->grabbed = 1;
-                toggle_grab(keyboard);
-                libevdev_grab(keyboard->evdev, LIBEVDEV_GRAB);
-                // printf("Keyboard grabbed\n");
-            }
-            else {
-                keyboard->grabbed = 0;
-                libevdev_uinput_write_event(keyboard->output_device, EV_KEY, event->code, event->value);
-                libevdev_uinput_write_event(keyboard->output_device, EV_SYN, SYN_REPORT, 0);
-                libevdev_grab(keyboard->evdev, LIBEVDEV_UNGRAB);
-                // printf("Keyboard ungrabbed\n");
-            }
-        }
-        grab.count = 0;
+static void keyboard_repeat_arm(struct virtual_keyboard *keyboard, bool arm)
+{
+    struct itimerspec timer = {0};
+    uint64_t period_ns = 1000000000ULL / keyboard->repeat->rate;
+
+    if (arm) {
+        timer.it_value.tv_sec = keyboard->repeat->delay_ms / 1000;
+        timer.it_value.tv_nsec = (keyboard->repeat->delay_ms % 1000) * 1000000;
+        timer.it_interval.tv_sec = period_ns / 1000000000ULL;
+        timer.it_interval.tv_nsec = period_ns % 1000000000ULL;
+    }
+    timerfd_settime(keyboard->repeat_fd, 0, &timer, NULL);
+}
+
+static void keyboard_repeat_stop(struct virtual_keyboard *keyboard)
+{
+    if (keyboard->repeat_fd < 0 || !keyboard->repeat_key)
         return;
+
+    keyboard->repeat_key = 0;
+    keyboard_repeat_arm(keyboard, false);
+}
+
+/* The last key pressed repeats until it is released, the way the kernel does it */
+static void keyboard_repeat_track(struct virtual_keyboard *keyboard, unsigned int key,
+    unsigned int code, int value, bool forwarded)
+{
+    if (value == 1 && forwarded) {
+        keyboard->repeat_key = key;
+        keyboard->repeat_code = code;
+        keyboard_repeat_arm(keyboard, true);
     }
-    grab.count++;
-}
-static int inline keyboard_grab(struct virtual_keyboard *keyboard, struct input_event *event)
-{
-    int code = event->code;
-
-    if (event->type == EV_KEY && event->value != 2) {
-        switch (code)
-        {
-            case KEY_LEFTCTRL:
-                grab.left_ctrl = event->value;
-                __keyboard_grab(keyboard, event);
-                break;
-            
-            case KEY_RIGHTCTRL:
-                grab.right_ctrl = event->value;
-                __keyboard_grab(keyboard, event);
-                
-                break;
-            default:
-                break;
-        }
+    else if (value == 0 && key == keyboard->repeat_key) {
+        keyboard_repeat_stop(keyboard);
+    }
+}
+
+/* One repeat per tick, a late loop does not make up the ones it missed */
+void keyboard_repeat(struct virtual_keyboard *keyboard)
+{
+    uint64_t expirations;
+
+    if (read(keyboard->repeat_fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    if (!keyboard->grabbed || !keyboard->repeat_key)
+        return;
+
+    frame_write(&keyboard->frame, EV_KEY, keyboard->repeat_code, 2);
+    frame_sync(&keyboard->frame);
+    frame_flush(&keyboard->frame);
+    keyboard->repeats_made++;
+}
+
+static void keyboard_set_grab(struct virtual_keyboard *keyboard, const struct chord *chord,
+    bool grab, struct input_event *event)
+{
+    if (keyboard->grabbed == grab)
+        return;
+
+    if (grab) {
+        /* QEMU saw none of the chord, replay its grab toggle */
+        keyboard->grabbed = 1;
+        if (keyboard->toggle_qemu)
+            toggle_grab(keyboard);
+        // printf("Keyboard grabbed\n");
     }
+    else {
+        /* The chord went through as typed, only QEMU's own chord toggles it back */
+        keyboard->grabbed = 0;
+        keyboard_repeat_stop(keyboard);
+        frame_sync(&keyboard->frame);
+        if (!chord->qemu_toggle && keyboard->toggle_qemu)
+            toggle_grab(keyboard);
+        // printf("Keyboard ungrabbed\n");
+    }
+    frame_mark(&keyboard->frame, STAT_GRAB, event_time_us(event));
+    keyboard_grab_global(keyboard, grab);
+}
+
+/*
+ * A press that makes the held keys exactly a chord arms it, any other
+ * press disarms. Returns false when the press belongs to us, not the guest.
+ */
+static bool keyboard_chord_press(struct virtual_keyboard *keyboard, unsigned int code)
+{
+    const struct chord *chord;
+    int match;
+
+    if (!keyboard->chords)
+        return true;
+
+    match = chord_match(keyboard->chords, keyboard->key_state, keyboard->keys_down, code);
+    keyboard->chord_armed = match;
+    if (match < 0)
+        return true;
+
+    chord = &keyboard->chords->chords[match];
+    if (chord->action == CHORD_TARGET) {
+        keyboard->switch_target = chord->target;
+        keyboard->swallowed_key = code;
+        keyboard->chord_armed = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void keyboard_chord_release(struct virtual_keyboard *keyboard, struct input_event *event)
+{
+    const struct chord *chord;
+
+    if (keyboard->chord_armed < 0)
+        return;
+
+    chord = &keyboard->chords->chords[keyboard->chord_armed];
+    if (!chord_released(chord, keyboard->key_state))
+        return;
+    keyboard->chord_armed = -1;
+
+    switch (chord->action)
+    {
+        case CHORD_TOGGLE:
+            keyboard_set_grab(keyboard, chord, !keyboard->grabbed, event);
+            break;
+
+        case CHORD_GRAB:
+            keyboard_set_grab(keyboard, chord, true, event);
+            break;
+
+        case CHORD_RELEASE:
+            keyboard_set_grab(keyboard, chord, false, event);
+            break;
 
-    return keyboard->grabbed;
+        default:
+            break;
+    }
 }
 
 static void __always_inline keyboard_write(struct virtual_keyboard *keyboard, struct input_event *event)
 {
-    if (keyboard_grab(keyboard, event)) {
-        libevdev_uinput_write_event(keyboard->output_device, event->type, event->code, event->value);
+    unsigned int code = event->code;
+    bool forward = true;
+
+    if (event->type == EV_KEY && event->value == 2) {
+        keyboard->repeats_in++;
+        if (keyboard->repeat->mode != REPEAT_FORWARD) {
+            keyboard->repeats_dropped++;
+            return;
+        }
+    }
+
+    if (event->type == EV_KEY && event->value == 1)
+        forward = keyboard_chord_press(keyboard, event->code);
+    /* The new pair never saw the press, a lone key-up would reach it */
+    else if (event->type == EV_KEY && keyboard->swallowed_key && event->code == keyboard->swallowed_key) {
+        forward = false;
+        if (event->value == 0)
+            keyboard->swallowed_key = 0;
+    }
+
+    /* Remapped and dropped keys cost the same as the rest: a load and a compare */
+    if (event->type == EV_KEY && event->code >= KEY_CNT) {
+        forward = false;
+    }
+    else if (event->type == EV_KEY) {
+        code = keyboard->keymap->codes[event->code];
+        atomic_fetch_add_explicit(&keyboard->keymap->hits[event->code], 1, memory_order_relaxed);
+        forward &= code != 0;
+    }
+
+    if (keyboard->grabbed && forward) {
+        frame_write(&keyboard->frame, event->type, code, event->value);
+        if (event->type == EV_KEY)
+            frame_mark(&keyboard->frame, STAT_KEY, event_time_us(event));
         // printf("keyboard: type: %x, code: %x, value: %d\n", event->type, event->code, event->value);
     }
+
+    if (event->type == EV_KEY && keyboard->repeat_fd >= 0)
+        keyboard_repeat_track(keyboard, event->code, code, event->value, keyboard->grabbed && forward);
+
+    /* After forwarding, so an ungrab chord's last key-up still reaches the guest */
+    if (event->type == EV_KEY && event->value == 0)
+        keyboard_chord_release(keyboard, event);
 }
 
-static int setup_keyboard(struct libevdev_uinput **output_device)
+/* Only codes something maps to are advertised */
+int setup_keyboard(struct libevdev_uinput **output_device, int index, const struct keymap *keymap)
 {
     int ret;
+    char name[32] = "Virtual Keyboard";
     struct input_id vid = {
         .bustype = BUS_USB,
         .vendor  = 0x1234,
         .product = 0x5679,
-        .version = 1,
+        .version = index + 1,
     };
 
+    if (index)
+        snprintf(name, sizeof(name), "Virtual Keyboard %d", index + 1);
+
     struct libevdev *dev = libevdev_new();
-    libevdev_set_name(dev, "Virtual Keyboard");
+    libevdev_set_name(dev, name);
     libevdev_set_id_vendor(dev, vid.vendor);
     libevdev_set_id_product(dev, vid.product);
     libevdev_set_id_version(dev, vid.version);
 
-    for (int code = 1; code <= 248; code++) {
-        libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+    for (int code = 1; code < KEY_CNT; code++) {
+        if (keymap->codes[code])
+            libevdev_enable_event_code(dev, EV_KEY, keymap->codes[code], NULL);
     }
 
     ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, output_device);
@@ -126,49 +241,124 @@ static int setup_keyboard(struct libevdev_uinput **output_device)
     return ret;
 }
 
-void keyboard_handle_events(struct virtual_keyboard *keyboard)
+/* Repeats in a frame of nothing else, 0 when the frame carries anything more */
+static int keyboard_repeat_count(struct input_event *events, int count)
 {
-    struct input_event events[MAX_EVENTS];
-    int count = 0, ret, flag,  sync = false;
+    int repeats = 0;
 
-    while (count < (int)MAX_EVENTS) {
-        if (sync)
-            flag = LIBEVDEV_READ_FLAG_SYNC;
-        else
-            flag = LIBEVDEV_READ_FLAG_NORMAL;
+    for (int i = 0; i < count; i++) {
+        if (events[i].type == EV_KEY && events[i].value == 2)
+            repeats++;
+        else if (events[i].type != EV_SYN && events[i].type != EV_MSC)
+            return 0;
+    }
 
-        ret = libevdev_next_event(keyboard->evdev, flag, &events[count]);
-        if (ret == LIBEVDEV_READ_STATUS_SUCCESS || ret == LIBEVDEV_READ_STATUS_SYNC) {
-            sync = (ret == LIBEVDEV_READ_STATUS_SYNC);
-        } 
-        else if (ret == -EAGAIN || ret == -EINTR) {
-            break;
+    return repeats;
+}
+
+static void keyboard_handle_frame(struct virtual_keyboard *keyboard,
+    struct input_event *events, int count)
+{
+    int repeats;
+
+    TRACE(keyboard_in, count, event_time_us(&events[count - 1]));
+
+    /* A repeat-only frame goes whole, an empty SYN_REPORT would still cost a write */
+    if (keyboard->repeat->mode != REPEAT_FORWARD && (repeats = keyboard_repeat_count(events, count))) {
+        keyboard->repeats_in += repeats;
+        keyboard->repeats_dropped += repeats;
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct input_event *event = &events[i];
+
+        if (event->type == EV_KEY && event->value != 2 && event->code < KEY_CNT &&
+            bit_is_set(keyboard->key_state, event->code) != !!event->value) {
+            set_bit(keyboard->key_state, event->code, event->value);
+            if (event->value)
+                keyboard->keys_down++;
+            else
+                keyboard->keys_down--;
         }
-        count++;
+        keyboard_write(keyboard, event);
     }
+}
+
+/*
+ * The kernel dropped events, compare the key state we have seen with the
+ * device's and replay the difference as one frame.
+ */
+static void keyboard_resync(struct virtual_keyboard *keyboard)
+{
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+    struct input_event event = { .type = EV_KEY };
+    uint64_t now = monotonic_us();
 
-    if (count == (int)MAX_EVENTS) {
-        fprintf(stderr, "Events from evdev: %s exceeded limit: %d. This is an application bug!\n", libevdev_get_name(keyboard->evdev), MAX_EVENTS);
+    if (ioctl(keyboard->fd, EVIOCGKEY(sizeof(key_state)), key_state) < 0) {
+        fprintf(stderr, "Failed to resync keyboard %s: %s\n", libevdev_get_name(keyboard->evdev), strerror(errno));
+        return;
     }
 
-    for (int i = 0; i < count; i++)
-        keyboard_write(keyboard, &events[i]);
+    /* Stamped now, a zero time would go into the latency histogram as the whole uptime */
+    event.input_event_sec = now / 1000000;
+    event.input_event_usec = now % 1000000;
+
+    for (unsigned int code = 0; code < KEY_CNT; code++) {
+        if (bit_is_set(key_state, code) == bit_is_set(keyboard->key_state, code))
+            continue;
+
+        event.code = code;
+        event.value = bit_is_set(key_state, code);
+        keyboard_handle_frame(keyboard, &event, 1);
+    }
+
+    event.type = EV_SYN;
+    event.code = SYN_REPORT;
+    event.value = 0;
+    keyboard_write(keyboard, &event);
+}
+
+void keyboard_handle_events(struct virtual_keyboard *keyboard)
+{
+    struct input_event *events;
+    uint64_t events_read = keyboard->reader.events_read;
+    int count, more;
+
+    do {
+        more = reader_fill(&keyboard->reader, keyboard->fd);
+        if (more < 0) {
+            fprintf(stderr, "Failed to read keyboard %s: %s\n", libevdev_get_name(keyboard->evdev), strerror(-more));
+            break;
+        }
+
+        while ((count = reader_next_frame(&keyboard->reader, &events)) != 0) {
+            if (count == READER_RESYNC) {
+                keyboard_resync(keyboard);
+                continue;
+            }
+
+            if (keyboard->recorder)
+                recorder_write(keyboard->recorder, RECORD_KEYBOARD, events, count);
+            keyboard_handle_frame(keyboard, events, count);
+        }
+    } while (more);
+
+    frame_flush(&keyboard->frame);
+    keyboard->stats.wakeups++;
+    hist_add(&keyboard->stats.batch, keyboard->reader.events_read - events_read);
 }
 
 void keyboard_flush(struct virtual_keyboard *keyboard)
 {
-    struct input_event ev;
-    int ret = 1;
-    while (ret > 0 ) {
-        ret = libevdev_next_event(keyboard->evdev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-    }
+    reader_drain(&keyboard->reader, keyboard->fd);
 }
 
-int keyboard_create(const char *path, struct virtual_keyboard *keyboard)
+int keyboard_create(const char *path, struct virtual_keyboard *keyboard, struct output_sink *sink)
 {
     int fd, ret;
 
-    fd = open(path, O_RDONLY | O_NONBLOCK);
+    fd = handover_open(path, O_RDONLY | O_NONBLOCK);
     if (fd < 0) {
         fprintf(stderr, "Failed to open fd for keyboard %s: %s\n", path, strerror(errno));
         ret = -errno;\
@@ -182,17 +372,37 @@ int keyboard_create(const char *path, struct virtual_keyboard *keyboard)
     }
     libevdev_set_clock_id(keyboard->evdev, CLOCK_MONOTONIC);
 
-    ret = setup_keyboard(&keyboard->output_device);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to create uinput device: %s\n", strerror(-ret));
-        goto err_uinput;
+    keyboard->repeat_fd = -1;
+    keyboard->repeat_key = 0;
+    if (keyboard->repeat->mode == REPEAT_SYNTH) {
+        keyboard->repeat_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (keyboard->repeat_fd < 0) {
+            fprintf(stderr, "Failed to create repeat timer for keyboard: %s\n", strerror(errno));
+            ret = -errno;
+            goto err_timer;
+        }
     }
 
+    if (keyboard->exclusive)
+        libevdev_grab(keyboard->evdev, LIBEVDEV_GRAB);
+
+    frame_init(&keyboard->frame, sink, &keyboard->stats);
+    memset(&keyboard->reader, 0, sizeof(keyboard->reader));
+    memset(keyboard->key_state, 0, sizeof(keyboard->key_state));
+    /* Keys already held count towards chords, e.g. one begun before a grab */
+    ioctl(fd, EVIOCGKEY(sizeof(keyboard->key_state)), keyboard->key_state);
+    keyboard->keys_down = 0;
+    for (unsigned int word = 0; word < NLONGS(KEY_CNT); word++)
+        keyboard->keys_down += __builtin_popcountl(keyboard->key_state[word]);
+    keyboard->chord_armed = -1;
+    keyboard->switch_target = -1;
+    keyboard->swallowed_key = 0;
+
     keyboard->fd = fd;
 
     return ret;
 
-err_uinput:
+err_timer:
     libevdev_free(keyboard->evdev);
 err_evdev:
     close(fd);
@@ -200,17 +410,54 @@ err_open:
     return ret;
 }
 
+/*
+ * Send key-ups for everything still held, so nothing sticks in the guest.
+ * key_state is what is physically down and stays as it is: keys held
+ * through a target switch still count towards the next chord.
+ */
+void keyboard_release_keys(struct virtual_keyboard *keyboard)
+{
+    keyboard_repeat_stop(keyboard);
+
+    if (!keyboard->grabbed)
+        return;
+
+    for (unsigned int code = 0; code < KEY_CNT; code++) {
+        if (!bit_is_set(keyboard->key_state, code) || !keyboard->keymap->codes[code])
+            continue;
+
+        frame_write(&keyboard->frame, EV_KEY, keyboard->keymap->codes[code], 0);
+        frame_sync(&keyboard->frame);
+    }
+    keyboard->chord_armed = -1;
+    frame_flush(&keyboard->frame);
+}
+
 void keyboard_close(struct virtual_keyboard *keyboard)
 {
-    libevdev_uinput_destroy(keyboard->output_device);
     libevdev_free(keyboard->evdev);
     close(keyboard->fd);
+    if (keyboard->repeat_fd >= 0)
+        close(keyboard->repeat_fd);
+}
+
+/* Event volume on either side of the repeat filter */
+void keyboard_report(FILE *out, struct virtual_keyboard *keyboard)
+{
+    fprintf(out, "  events in %llu out %llu, host repeats %llu dropped %llu, made %llu\n",
+        (unsigned long long)keyboard->reader.events_read,
+        (unsigned long long)keyboard->frame.events_written,
+        (unsigned long long)keyboard->repeats_in,
+        (unsigned long long)keyboard->repeats_dropped,
+        (unsigned long long)keyboard->repeats_made);
 }
 
 void inline keyboard_grab_global(struct virtual_keyboard *keyboard, bool flag)
 {
-    if (flag)
-        libevdev_grab(keyboard->evdev, LIBEVDEV_GRAB);
-    else
-        libevdev_grab(keyboard->evdev, LIBEVDEV_UNGRAB);
+    /* Exclusive devices stay grabbed, only forwarding is toggled */
+    if (keyboard->exclusive)
+        return;
+
+    /* Not libevdev_grab, which skips the ungrab of a handed over fd it never saw grabbed */
+    ioctl(keyboard->fd, EVIOCGRAB, flag ? 1 : 0);
 }
\ No newline at end of file
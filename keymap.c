@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libevdev/libevdev.h>
+
+#include "virtual_mk.h"
+
+/* Accepts "KEY_A" as well as "A" */
+int key_from_name(const char *name)
+{
+    char prefixed[64];
+    int code;
+
+    code = libevdev_event_code_from_name(EV_KEY, name);
+    if (code >= 0)
+        return code;
+
+    snprintf(prefixed, sizeof(prefixed), "KEY_%s", name);
+    return libevdev_event_code_from_name(EV_KEY, prefixed);
+}
+
+/* Identity over the codes the virtual keyboard always had, the rest dropped */
+void keymap_init(struct keymap *keymap)
+{
+    memset(keymap, 0, sizeof(*keymap));
+    for (unsigned int code = 1; code <= KEYMAP_DEFAULT_LAST; code++)
+        keymap->codes[code] = code;
+}
+
+/*
+ * One mapping per line, "FROM TO" or "FROM drop", # starts a comment.
+ * A key mapped away keeps forwarding nothing under its own code. Any
+ * other line is an error, reported with its line number.
+ */
+int keymap_load(struct keymap *keymap, const char *path)
+{
+    char line[256], from[64], to[64];
+    int from_code, to_code, end, fields, n = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open keymap %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        n++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        end = 0;
+        fields = sscanf(line, " %63s %63s %n", from, to, &end);
+        if (fields <= 0)
+            continue;
+        if (fields != 2 || line[end]) {
+            fprintf(stderr, "%s:%d: expected \"FROM TO\" or \"FROM drop\": \"%s\"\n", path, n, line);
+            fclose(file);
+            return -EINVAL;
+        }
+
+        from_code = key_from_name(from);
+        to_code = strcmp(to, "drop") ? key_from_name(to) : 0;
+        if (from_code <= 0 || to_code < 0) {
+            fprintf(stderr, "%s:%d: unknown key in \"%s %s\"\n", path, n, from, to);
+            fclose(file);
+            return -EINVAL;
+        }
+
+        keymap->codes[from_code] = to_code;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+void keymap_report(FILE *out, const struct keymap *keymap)
+{
+    for (unsigned int code = 1; code < KEY_CNT; code++) {
+        unsigned int to = keymap->codes[code];
+        bool identity = to == code || (!to && code > KEYMAP_DEFAULT_LAST);
+
+        if (identity)
+            continue;
+
+        fprintf(out, "  keymap %s -> %s: %llu\n", libevdev_event_code_get_name(EV_KEY, code),
+            to ? libevdev_event_code_get_name(EV_KEY, to) : "drop",
+            (unsigned long long)atomic_load_explicit(&keymap->hits[code], memory_order_relaxed));
+    }
+}
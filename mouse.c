@@ -11,17 +11,22 @@
 #include "virtual_mk.h"
 #include "config.h"
 
-static int setup_virtual_mouse(struct libevdev_uinput **output_device) {
+/* Pair 0 keeps the plain name, the others are numbered through name and version */
+int setup_virtual_mouse(struct libevdev_uinput **output_device, int index) {
     int ret = 0;
+    char name[32] = "Virtual Mouse";
     struct input_id vid = {
         .bustype = BUS_USB,
         .vendor  = 0x1234,
         .product = 0x5678,
-        .version = 1,
+        .version = index + 1,
     };
 
+    if (index)
+        snprintf(name, sizeof(name), "Virtual Mouse %d", index + 1);
+
     struct libevdev *dev = libevdev_new();
-    libevdev_set_name(dev, "Virtual Mouse");
+    libevdev_set_name(dev, name);
     libevdev_set_id_vendor(dev, vid.vendor);
     libevdev_set_id_product(dev, vid.product);
     libevdev_set_id_version(dev, vid.version);
@@ -30,10 +35,15 @@ static int setup_virtual_mouse(struct libevdev_uinput **output_device) {
     libevdev_enable_event_code(dev, EV_REL, REL_Y, NULL);
     libevdev_enable_event_code(dev, EV_REL, REL_WHEEL, NULL);
     libevdev_enable_event_code(dev, EV_REL, REL_WHEEL_HI_RES, NULL);
+    libevdev_enable_event_code(dev, EV_REL, REL_HWHEEL, NULL);
+    libevdev_enable_event_code(dev, EV_REL, REL_HWHEEL_HI_RES, NULL);
     libevdev_enable_event_type(dev, EV_KEY);
     libevdev_enable_event_code(dev, EV_KEY, BTN_LEFT, NULL);
     libevdev_enable_event_code(dev, EV_KEY, BTN_RIGHT, NULL);
     libevdev_enable_event_code(dev, EV_KEY, BTN_MIDDLE, NULL);
+    /* Side buttons only come from relative sources, which are copied as they are */
+    libevdev_enable_event_code(dev, EV_KEY, BTN_SIDE, NULL);
+    libevdev_enable_event_code(dev, EV_KEY, BTN_EXTRA, NULL);
 
     ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, output_device);
     if (ret < 0) {
@@ -44,41 +54,199 @@ static int setup_virtual_mouse(struct libevdev_uinput **output_device) {
     return ret;
 }
 
-static void handle_pointer_motion(struct virtual_mouse *mouse,
-    struct libinput_event_pointer *p_event, int type)
+/*
+ * The passthrough device: the source touchpad's ABS_MT_* axes with their
+ * ranges and resolution, its buttons and properties, under our own name.
+ */
+int setup_virtual_touchpad(struct libevdev_uinput **output_device, int index, int source_fd) {
+    int ret = 0;
+    char name[32] = "Virtual Touchpad";
+    struct input_id vid = {
+        .bustype = BUS_USB,
+        .vendor  = 0x1234,
+        .product = 0x567a,
+        .version = index + 1,
+    };
+    struct libevdev *source;
+
+    if (index)
+        snprintf(name, sizeof(name), "Virtual Touchpad %d", index + 1);
+
+    ret = libevdev_new_from_fd(source_fd, &source);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to read touchpad capabilities: %s\n", strerror(-ret));
+        return ret;
+    }
+
+    struct libevdev *dev = libevdev_new();
+    libevdev_set_name(dev, name);
+    libevdev_set_id_vendor(dev, vid.vendor);
+    libevdev_set_id_product(dev, vid.product);
+    libevdev_set_id_version(dev, vid.version);
+    for (unsigned int code = 0; code < ABS_CNT; code++) {
+        if (libevdev_has_event_code(source, EV_ABS, code))
+            libevdev_enable_event_code(dev, EV_ABS, code, libevdev_get_abs_info(source, code));
+    }
+    for (unsigned int code = BTN_MISC; code < KEY_CNT; code++) {
+        if (libevdev_has_event_code(source, EV_KEY, code))
+            libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+    }
+    if (libevdev_has_event_code(source, EV_MSC, MSC_TIMESTAMP))
+        libevdev_enable_event_code(dev, EV_MSC, MSC_TIMESTAMP, NULL);
+    for (unsigned int prop = 0; prop < INPUT_PROP_CNT; prop++) {
+        if (libevdev_has_property(source, prop))
+            libevdev_enable_property(dev, prop);
+    }
+
+    ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, output_device);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create uinput device: %s\n", strerror(-ret));
+    }
+
+    libevdev_free(dev);
+    libevdev_free(source);
+    return ret;
+}
+
+static void motion_flush(struct virtual_mouse *mouse)
+{
+    struct motion_accum *motion = &mouse->motion;
+    struct output_frame *frame = &mouse->frame;
+    int dx, dy;
+
+    if (!motion->pending)
+        return;
+
+    /* Truncate toward zero and keep the remainder for the next dispatch */
+    dx = (int)motion->x;
+    dy = (int)motion->y;
+    motion->x -= dx;
+    motion->y -= dy;
+    motion->pending = false;
+
+    if (!dx && !dy)
+        return;
+
+    if (dx)
+        frame_write(frame, EV_REL, REL_X, dx);
+    if (dy)
+        frame_write(frame, EV_REL, REL_Y, dy);
+    frame_sync(frame);
+    frame_mark(frame, STAT_MOTION, motion->time_us);
+}
+
+static void scroll_flush(struct virtual_mouse *mouse)
+{
+    static const uint16_t wheel_codes[SCROLL_AXIS_MAX][2] = {
+        [SCROLL_VERTICAL] = { REL_WHEEL, REL_WHEEL_HI_RES },
+        [SCROLL_HORIZONTAL] = { REL_HWHEEL, REL_HWHEEL_HI_RES },
+    };
+    struct scroll_accum *scroll = &mouse->scroll;
+    struct output_frame *frame = &mouse->frame;
+    bool written = false;
+
+    if (!scroll->pending)
+        return;
+
+    for (int axis = 0; axis < SCROLL_AXIS_MAX; axis++) {
+        int hi_res = (int)scroll->hi_res[axis];
+        int wheel;
+
+        if (!hi_res)
+            continue;
+
+        scroll->hi_res[axis] -= hi_res;
+
+        /* A direction change starts a new detent */
+        if ((hi_res > 0) != (scroll->detent[axis] > 0))
+            scroll->detent[axis] = 0;
+        scroll->detent[axis] += hi_res;
+        wheel = scroll->detent[axis] / 120;
+        scroll->detent[axis] -= wheel * 120;
+
+        if (wheel)
+            frame_write(frame, EV_REL, wheel_codes[axis][0], wheel);
+        frame_write(frame, EV_REL, wheel_codes[axis][1], hi_res);
+        written = true;
+    }
+    scroll->pending = false;
+
+    if (written) {
+        frame_sync(frame);
+        frame_mark(frame, STAT_SCROLL, scroll->time_us);
+    }
+}
+
+/* merged counts the source events folded into what this flush writes */
+void mouse_flush(struct virtual_mouse *mouse)
 {
-    struct libevdev_uinput *virt_mouse = mouse->output_device;
-    double dx = libinput_event_pointer_get_dx_unaccelerated(p_event);
-    double dy = libinput_event_pointer_get_dy_unaccelerated(p_event);
+    motion_flush(mouse);
+    scroll_flush(mouse);
 
-    dx = floor_or_ceil(dx * (double)X_SCALE);
-    dy = floor_or_ceil(dy * (double)Y_SCALE);
+    if (mouse->merged) {
+        hist_add(&mouse->stats.merged, mouse->merged);
+        mouse->merged = 0;
+    }
+}
 
-    libevdev_uinput_write_event(virt_mouse, EV_REL, REL_X, (int)dx);
-    libevdev_uinput_write_event(virt_mouse, EV_REL, REL_Y, (int)dy);
-    libevdev_uinput_write_event(virt_mouse, EV_SYN, SYN_REPORT, 0);
+static void pointer_reset(struct virtual_mouse *mouse)
+{
+    mouse->motion.x = 0;
+    mouse->motion.y = 0;
+    mouse->motion.pending = false;
+    memset(&mouse->scroll, 0, sizeof(mouse->scroll));
+    mouse->merged = 0;
+}
 
+/* dx/dy in libinput's unaccelerated units, i.e. normalized to 1000dpi */
+void mouse_motion(struct virtual_mouse *mouse, double dx, double dy, uint64_t time_us)
+{
+    struct motion_accum *motion = &mouse->motion;
+    uint64_t dt = time_us > motion->last_us ? time_us - motion->last_us : 0;
+    double gain;
+
+    TRACE(mouse_in, STAT_MOTION, time_us);
+
+    /* The first event after a pause would otherwise look infinitely fast or slow */
+    if (!motion->last_us || dt > ACCEL_IDLE_US)
+        dt = ACCEL_IDLE_US;
+    else if (dt < ACCEL_MIN_INTERVAL_US)
+        dt = ACCEL_MIN_INTERVAL_US;
+    motion->last_us = time_us;
+
+    gain = accel_gain(hypot(dx, dy) * 1000.0 / dt);
+    motion->x += dx * gain;
+    motion->y += dy * gain;
+    mouse->merged++;
+
+    if (!motion->pending) {
+        motion->time_us = time_us;
+        motion->pending = true;
+    }
 }
 
-static void handle_pointer_button(struct virtual_mouse *mouse,
-    struct libinput_event_pointer *p_event, int type)
+void mouse_button(struct virtual_mouse *mouse, uint32_t button, int state, uint64_t time_us)
 {
-    struct libevdev_uinput *virt_mouse = mouse->output_device;
+    struct output_frame *frame = &mouse->frame;
+
+    // printf("Button: %x state: %d\n", button, state);
+    TRACE(mouse_in, STAT_BUTTON, time_us);
 
-    uint32_t button = libinput_event_pointer_get_button(p_event);
-    int button_state = libinput_event_pointer_get_button_state(p_event);
-    // printf("Button: %x state: %d\n", button, button_state);
+    /* Motion that happened before the click has to land before it */
+    mouse_flush(mouse);
+    frame_mark(frame, STAT_BUTTON, time_us);
 
     switch (button)
     {
         case BTN_LEFT:
-            libevdev_uinput_write_event(virt_mouse, EV_KEY, BTN_LEFT, button_state);
-            libevdev_uinput_write_event(virt_mouse, EV_SYN, SYN_REPORT, 0);
-            break;
-        
         case BTN_RIGHT:
-            libevdev_uinput_write_event(virt_mouse, EV_KEY, BTN_RIGHT, button_state);
-            libevdev_uinput_write_event(virt_mouse, EV_SYN, SYN_REPORT, 0);
+        case BTN_MIDDLE:
+            frame_write(frame, EV_KEY, button, state);
+            frame_sync(frame);
+            if (state)
+                mouse->buttons |= 1 << (button - BTN_LEFT);
+            else
+                mouse->buttons &= ~(1 << (button - BTN_LEFT));
             break;
 
         default:
@@ -86,22 +254,70 @@ static void handle_pointer_button(struct virtual_mouse *mouse,
     }
 }
 
+/*
+ * value is a finger scroll distance in libinput's convention, positive
+ * for down/right. 0 ends the scroll on that axis.
+ */
+void mouse_scroll(struct virtual_mouse *mouse, enum scroll_axis axis, double value, uint64_t time_us)
+{
+    struct scroll_accum *scroll = &mouse->scroll;
+
+    TRACE(mouse_in, STAT_SCROLL, time_us);
+
+    /*
+     * Whole units still waiting go out first, motion ahead of them as on a
+     * click; only the fraction left over would overshoot the next scroll.
+     */
+    if (value == 0) {
+        if (scroll->pending)
+            mouse_flush(mouse);
+        scroll->hi_res[axis] = 0;
+        scroll->detent[axis] = 0;
+        return;
+    }
+
+    /* Wheel up is positive, libinput scrolls down with positive values */
+    if (axis == SCROLL_VERTICAL)
+        value = -value;
+
+    scroll->hi_res[axis] += value * 120.0 / (double)SCROLL_DETENT_DISTANCE;
+    mouse->merged++;
+    if (!scroll->pending) {
+        scroll->time_us = time_us;
+        scroll->pending = true;
+    }
+}
+
+static void handle_pointer_motion(struct virtual_mouse *mouse,
+    struct libinput_event_pointer *p_event, int type)
+{
+    mouse_motion(mouse, libinput_event_pointer_get_dx_unaccelerated(p_event),
+        libinput_event_pointer_get_dy_unaccelerated(p_event),
+        libinput_event_pointer_get_time_usec(p_event));
+}
+
+static void handle_pointer_button(struct virtual_mouse *mouse,
+    struct libinput_event_pointer *p_event, int type)
+{
+    mouse_button(mouse, libinput_event_pointer_get_button(p_event),
+        libinput_event_pointer_get_button_state(p_event),
+        libinput_event_pointer_get_time_usec(p_event));
+}
+
 static void handle_pointer_scroll(struct virtual_mouse *mouse,
     struct libinput_event_pointer *p_event, int type)
 {
-    struct libevdev_uinput *virt_mouse = mouse->output_device;
-    double y_scroll;
-    
-    if (libinput_event_pointer_has_axis(p_event, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL)) {
-        y_scroll = libinput_event_pointer_get_scroll_value(p_event,
-                        LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
-
-        if (y_scroll != (double)(0)) {
-            libevdev_uinput_write_event(virt_mouse, EV_REL, REL_WHEEL, y_scroll > 0 ? -SCROLL : SCROLL);
-            libevdev_uinput_write_event(virt_mouse, EV_REL, REL_WHEEL_HI_RES,
-                y_scroll > 0 ? -SCROLL_HIGH_RES : SCROLL_HIGH_RES);
-            libevdev_uinput_write_event(virt_mouse, EV_SYN, SYN_REPORT, 0);
-        }
+    static const enum libinput_pointer_axis axes[SCROLL_AXIS_MAX] = {
+        [SCROLL_VERTICAL] = LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL,
+        [SCROLL_HORIZONTAL] = LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL,
+    };
+
+    for (int axis = 0; axis < SCROLL_AXIS_MAX; axis++) {
+        if (!libinput_event_pointer_has_axis(p_event, axes[axis]))
+            continue;
+
+        mouse_scroll(mouse, axis, libinput_event_pointer_get_scroll_value(p_event, axes[axis]),
+            libinput_event_pointer_get_time_usec(p_event));
     }
 }
 
@@ -110,6 +326,21 @@ void mouse_handle_events(struct virtual_mouse *mouse) {
     struct libinput_event *event;
     int event_count = 0;
 
+    if (mouse->backend == MOUSE_BACKEND_NATIVE) {
+        touchpad_handle_events(mouse);
+        return;
+    }
+
+    if (mouse->backend == MOUSE_BACKEND_PASSTHROUGH) {
+        touchpad_passthrough_events(mouse);
+        return;
+    }
+
+    if (mouse->backend == MOUSE_BACKEND_RELATIVE) {
+        relative_handle_events(mouse);
+        return;
+    }
+
     while ((event = libinput_get_event(libinput)) != NULL) {
         event_count++;
         int type = libinput_event_get_type(event);
@@ -143,6 +374,14 @@ void mouse_handle_events(struct virtual_mouse *mouse) {
         }
         libinput_event_destroy(event);
     }
+    /* Paced motion waits for the scheduler tick, buttons already went into the frame */
+    if (!mouse->scheduler)
+        mouse_flush(mouse);
+    else if (mouse->motion.pending || mouse->scroll.pending)
+        scheduler_arm(mouse->scheduler);
+    frame_flush(&mouse->frame);
+    mouse->stats.wakeups++;
+    hist_add(&mouse->stats.batch, event_count);
     // printf("Event count: %d | call_count :%lld\n", event_count, call_count);
 }
 
@@ -150,7 +389,7 @@ static int open_restricted(const char *path, int flags, void *user_data) {
     int fd;
     struct virtual_mouse *mouse = (struct virtual_mouse *)user_data;
 
-    fd = open(path, flags);
+    fd = handover_open(path, flags);
     if (fd < 0) {
         fprintf(stderr, "Failed to open file descriptor: %s\n", strerror(errno));
         return -errno;
@@ -161,12 +400,25 @@ static int open_restricted(const char *path, int flags, void *user_data) {
 }
 
 static void close_restricted(int fd, void *user_data) {
+    struct virtual_mouse *mouse = (struct virtual_mouse *)user_data;
+
+    if (mouse->evdev_fd == fd)
+        mouse->evdev_fd = -1;
     close(fd);
 }
 
-int mouse_create(const char *path, struct virtual_mouse *mouse)
+/* libinput's tapping has its own thresholds, only on or off follows --tap */
+static void mouse_configure(struct virtual_mouse *mouse, struct libinput_device *device)
+{
+    libinput_device_config_tap_set_enabled(device, mouse->tap && mouse->tap->timeout_us ?
+        LIBINPUT_CONFIG_TAP_ENABLED : LIBINPUT_CONFIG_TAP_DISABLED);
+    // libinput_device_config_tap_set_drag_enabled(device, LIBINPUT_CONFIG_DRAG_ENABLED);
+    /* Deltas are read unaccelerated, acceleration is ours */
+    libinput_device_config_accel_set_profile(device, LIBINPUT_CONFIG_ACCEL_PROFILE_FLAT);
+}
+
+static int mouse_create_libinput(const char *path, struct virtual_mouse *mouse)
 {
-    int ret = 0;
     const static struct libinput_interface interface = {
         .open_restricted = open_restricted,
         .close_restricted = close_restricted,
@@ -181,37 +433,166 @@ int mouse_create(const char *path, struct virtual_mouse *mouse)
     struct libinput_device *device = libinput_path_add_device(mouse->libinput_context, path);
     if (!device) {
         fprintf(stderr, "Failed to add device %s: %s\n", path, strerror(errno));
-        ret = -errno;
-        goto error_virt_mouse;
+        libinput_unref(mouse->libinput_context);
+        return -errno;
     }
     mouse->libinput_fd = libinput_get_fd(mouse->libinput_context);
+    mouse->fd = mouse->libinput_fd;
+    mouse_configure(mouse, device);
+
+    return 0;
+}
+
+static void mouse_close_backend(struct virtual_mouse *mouse)
+{
+    if (mouse->backend != MOUSE_BACKEND_LIBINPUT)
+        touchpad_close(mouse);
+    else
+        libinput_unref(mouse->libinput_context);
+}
 
-    ret = setup_virtual_mouse(&mouse->output_device);
+int mouse_create(const char *path, struct virtual_mouse *mouse, struct output_sink *sink)
+{
+    int ret = 0;
+
+    /* A mouse needs none of the touchpad handling, whichever backend was asked for */
+    if (relative_probe(path))
+        mouse->backend = MOUSE_BACKEND_RELATIVE;
+
+    if (mouse->backend == MOUSE_BACKEND_RELATIVE)
+        ret = relative_create(path, mouse);
+    else if (mouse->backend != MOUSE_BACKEND_LIBINPUT)
+        ret = touchpad_create(path, mouse);
+    else
+        ret = mouse_create_libinput(path, mouse);
     if (ret < 0)
-        goto error_virt_mouse;
+        return ret;
 
-    libinput_device_config_tap_set_enabled(device, LIBINPUT_CONFIG_TAP_ENABLED);
-    // libinput_device_config_tap_set_drag_enabled(device, LIBINPUT_CONFIG_DRAG_ENABLED);
-    libinput_device_config_accel_set_speed(device, LIBINPUT_CONFIG_ACCEL_PROFILE_NONE);
+    if (mouse->exclusive)
+        ioctl(mouse->evdev_fd, EVIOCGRAB, 1);
+
+    frame_init(&mouse->frame, sink, &mouse->stats);
 
     return ret;
-error_virt_mouse:
-    libinput_unref(mouse->libinput_context);
-    return ret;
+}
+
+/* Flush what is pending and let go of held buttons on the current output */
+void mouse_release_buttons(struct virtual_mouse *mouse)
+{
+    if (!mouse->grabbed)
+        return;
+
+    if (mouse->backend == MOUSE_BACKEND_PASSTHROUGH) {
+        touchpad_passthrough_release(mouse);
+        return;
+    }
+
+    /* The drag's button goes below, lifting the finger must not release it again */
+    if (mouse->backend == MOUSE_BACKEND_NATIVE) {
+        mouse->touchpad.tap.dragging = false;
+        mouse->touchpad.tap.drag_armed = false;
+    }
+
+    mouse_flush(mouse);
+    for (uint32_t button = BTN_LEFT; button <= BTN_EXTRA; button++) {
+        if (!(mouse->buttons & (1 << (button - BTN_LEFT))))
+            continue;
+
+        frame_write(&mouse->frame, EV_KEY, button, 0);
+        frame_sync(&mouse->frame);
+    }
+    mouse->buttons = 0;
+    frame_flush(&mouse->frame);
+}
+
+/*
+ * Stops reading the touchpad while ungrabbed, nothing it sends would be
+ * forwarded. libinput closes the device and its fd goes quiet; the native
+ * backend's fd is taken off the event loop by the caller. Exclusive
+ * devices keep running, closing them would hand them to the host.
+ */
+void mouse_suspend(struct virtual_mouse *mouse)
+{
+    struct libinput_event *event;
+
+    if (mouse->suspended || mouse->exclusive)
+        return;
+
+    if (mouse->backend == MOUSE_BACKEND_LIBINPUT) {
+        libinput_suspend(mouse->libinput_context);
+        libinput_dispatch(mouse->libinput_context);
+        while ((event = libinput_get_event(mouse->libinput_context)) != NULL)
+            libinput_event_destroy(event);
+    }
+
+    pointer_reset(mouse);
+    mouse->suspended = true;
+}
+
+/*
+ * Nothing from the suspended time is replayed: libinput reopens the device
+ * fresh, the native backend drops its queue and resyncs the slots, so the
+ * first motion after a grab is relative to where the fingers are now.
+ */
+int mouse_resume(struct virtual_mouse *mouse)
+{
+    struct libinput_event *event;
+
+    if (!mouse->suspended)
+        return 0;
+
+    if (mouse->backend == MOUSE_BACKEND_LIBINPUT) {
+        if (libinput_resume(mouse->libinput_context) < 0) {
+            fprintf(stderr, "Failed to resume touchpad\n");
+            return -EIO;
+        }
+
+        /* The device comes back as a new one with default settings */
+        libinput_dispatch(mouse->libinput_context);
+        while ((event = libinput_get_event(mouse->libinput_context)) != NULL) {
+            if (libinput_event_get_type(event) == LIBINPUT_EVENT_DEVICE_ADDED)
+                mouse_configure(mouse, libinput_event_get_device(event));
+            libinput_event_destroy(event);
+        }
+    }
+    else if (mouse->backend == MOUSE_BACKEND_RELATIVE) {
+        relative_resume(mouse);
+    }
+    else {
+        touchpad_resume(mouse);
+    }
+
+    pointer_reset(mouse);
+    mouse->motion.last_us = 0;
+    mouse->suspended = false;
+    return 0;
 }
 
 void mouse_close(struct virtual_mouse *mouse)
 {
-    libevdev_uinput_destroy(mouse->output_device);
-    libinput_unref(mouse->libinput_context);
+    mouse_close_backend(mouse);
 }
 
 void inline mouse_grab_global(struct virtual_mouse *mouse, bool grab)
 {
+    /* libinput reopens the device on resume, so that comes before the grab */
     if (grab)
-        ioctl(mouse->evdev_fd, EVIOCGRAB, 1);
+        mouse_resume(mouse);
+    /* Suspending drops the source's own releases, anything held would stay down in the guest */
     else
-        ioctl(mouse->evdev_fd, EVIOCGRAB, 0);
+        mouse_release_buttons(mouse);
+
+    /* Exclusive devices stay grabbed, only forwarding is toggled */
+    if (!mouse->exclusive) {
+        if (grab)
+            ioctl(mouse->evdev_fd, EVIOCGRAB, 1);
+        else
+            ioctl(mouse->evdev_fd, EVIOCGRAB, 0);
+    }
 
+    pointer_reset(mouse);
     mouse->grabbed = grab;
+
+    if (!grab)
+        mouse_suspend(mouse);
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "virtual_mk.h"
+
+static void output_devnode(char *devnode, struct libevdev_uinput *device)
+{
+    const char *node = device ? libevdev_uinput_get_devnode(device) : NULL;
+
+    snprintf(devnode, DEVICE_NAME_SIZE, "%s", node ? node : "");
+}
+
+/* qmp_path is only used by the QMP sink, both devices share its connection */
+int output_create(struct virtual_output *output, enum sink_type type, int index,
+    const char *qmp_path, const struct keymap *keymap)
+{
+    int ret;
+
+    output->mouse_device = NULL;
+    output->keyboard_device = NULL;
+
+    if (type == SINK_UINPUT) {
+        ret = setup_virtual_mouse(&output->mouse_device, index);
+        if (ret < 0)
+            return ret;
+
+        ret = setup_keyboard(&output->keyboard_device, index, keymap);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to create uinput device: %s\n", strerror(-ret));
+            libevdev_uinput_destroy(output->mouse_device);
+            return ret;
+        }
+    }
+
+    output->borrowed = false;
+    output_devnode(output->mouse_devnode, output->mouse_device);
+    output_devnode(output->keyboard_devnode, output->keyboard_device);
+
+    sink_init(&output->mouse_sink, type,
+        output->mouse_device ? libevdev_uinput_get_fd(output->mouse_device) : -1);
+    sink_init(&output->keyboard_sink, type,
+        output->keyboard_device ? libevdev_uinput_get_fd(output->keyboard_device) : -1);
+
+    if (type == SINK_QMP) {
+        qmp_init(&output->qmp, qmp_path);
+        output->mouse_sink.qmp = &output->qmp;
+        output->keyboard_sink.qmp = &output->qmp;
+    }
+
+    return 0;
+}
+
+/*
+ * Takes over a uinput pair created by the process we replace. The devices
+ * are the ones the guest already has open, so nothing is set up here and
+ * the pair is only borrowed until handover_finish.
+ */
+void output_inherit(struct virtual_output *output, int mouse_fd, int keyboard_fd,
+    const char *mouse_devnode, const char *keyboard_devnode)
+{
+    output->mouse_device = NULL;
+    output->keyboard_device = NULL;
+    output->borrowed = true;
+    snprintf(output->mouse_devnode, sizeof(output->mouse_devnode), "%s", mouse_devnode);
+    snprintf(output->keyboard_devnode, sizeof(output->keyboard_devnode), "%s", keyboard_devnode);
+
+    sink_init(&output->mouse_sink, SINK_UINPUT, mouse_fd);
+    sink_init(&output->keyboard_sink, SINK_UINPUT, keyboard_fd);
+}
+
+/* An inherited device has no libevdev handle, it goes the way libevdev_uinput_destroy does */
+static void output_destroy_fd(struct output_sink *sink, bool borrowed)
+{
+    if (sink->type != SINK_UINPUT || sink->fd < 0)
+        return;
+
+    if (!borrowed)
+        ioctl(sink->fd, UI_DEV_DESTROY, NULL);
+    close(sink->fd);
+}
+
+void output_destroy(struct virtual_output *output, int index)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "Virtual Mouse %d", index + 1);
+    sink_report(name, &output->mouse_sink);
+    snprintf(name, sizeof(name), "Virtual Keyboard %d", index + 1);
+    sink_report(name, &output->keyboard_sink);
+    if (output->keyboard_sink.type == SINK_QMP)
+        qmp_close(&output->qmp);
+    if (output->mouse_device) {
+        libevdev_uinput_destroy(output->mouse_device);
+        libevdev_uinput_destroy(output->keyboard_device);
+        return;
+    }
+
+    output_destroy_fd(&output->mouse_sink, output->borrowed);
+    output_destroy_fd(&output->keyboard_sink, output->borrowed);
+}
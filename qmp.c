@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+/*
+ * QEMU's "number" key type takes PC set 1 scancodes, extended keys with
+ * bit 7 set. Linux codes up to KEY_F12 are the set 1 scancodes already,
+ * except 84, which is unused, and KEY_ZENKAKUHANKAKU.
+ */
+static const uint8_t qmp_extended_keys[KEY_CNT] = {
+    [KEY_ZENKAKUHANKAKU] = 0x76,
+    [KEY_KPENTER] = 0x9c,
+    [KEY_RIGHTCTRL] = 0x9d,
+    [KEY_KPSLASH] = 0xb5,
+    [KEY_SYSRQ] = 0xb7,
+    [KEY_RIGHTALT] = 0xb8,
+    [KEY_HOME] = 0xc7,
+    [KEY_UP] = 0xc8,
+    [KEY_PAGEUP] = 0xc9,
+    [KEY_LEFT] = 0xcb,
+    [KEY_RIGHT] = 0xcd,
+    [KEY_END] = 0xcf,
+    [KEY_DOWN] = 0xd0,
+    [KEY_PAGEDOWN] = 0xd1,
+    [KEY_INSERT] = 0xd2,
+    [KEY_DELETE] = 0xd3,
+    [KEY_MUTE] = 0xa0,
+    [KEY_VOLUMEDOWN] = 0xae,
+    [KEY_VOLUMEUP] = 0xb0,
+    [KEY_PAUSE] = 0xc6,
+    [KEY_LEFTMETA] = 0xdb,
+    [KEY_RIGHTMETA] = 0xdc,
+    [KEY_COMPOSE] = 0xdd,
+};
+
+static int qmp_key_number(unsigned int code)
+{
+    if (code <= KEY_F12 && code != 84 && code != KEY_ZENKAKUHANKAKU)
+        return code;
+
+    return code < KEY_CNT ? qmp_extended_keys[code] : 0;
+}
+
+static bool qmp_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(buf + *len, size - *len, fmt, args);
+    va_end(args);
+
+    if (ret < 0 || (size_t)ret >= size - *len)
+        return false;
+
+    *len += ret;
+    return true;
+}
+
+#define qmp_event(...) ({ \
+    if (!qmp_append(buf, size, &len, "%s", count++ ? "," : "") || \
+        !qmp_append(buf, size, &len, __VA_ARGS__)) \
+        return 0; \
+})
+
+/*
+ * Turns one frame into a single input-send-event command. Wheel detents
+ * become wheel button clicks, hi-res scroll and SYN are implied. Returns
+ * the command length, 0 when nothing in the frame maps or it does not fit.
+ */
+static size_t qmp_format(const struct input_event *events, unsigned int event_count,
+    char *buf, size_t size)
+{
+    static const char *buttons[] = { "left", "right", "middle" };
+    const char *wheel;
+    size_t len = 0;
+    unsigned int count = 0;
+
+    if (!qmp_append(buf, size, &len, "{\"execute\":\"input-send-event\",\"arguments\":{\"events\":["))
+        return 0;
+
+    for (unsigned int i = 0; i < event_count; i++) {
+        const struct input_event *event = &events[i];
+
+        switch (event->type)
+        {
+            case EV_REL:
+                if (event->code == REL_X || event->code == REL_Y) {
+                    qmp_event("{\"type\":\"rel\",\"data\":{\"axis\":\"%c\",\"value\":%d}}",
+                        event->code == REL_X ? 'x' : 'y', event->value);
+                    break;
+                }
+
+                if (event->code == REL_WHEEL)
+                    wheel = event->value > 0 ? "wheel-up" : "wheel-down";
+                else if (event->code == REL_HWHEEL)
+                    wheel = event->value > 0 ? "wheel-right" : "wheel-left";
+                else
+                    break;
+
+                for (int n = 0; n < abs(event->value); n++) {
+                    qmp_event("{\"type\":\"btn\",\"data\":{\"down\":true,\"button\":\"%s\"}}", wheel);
+                    qmp_event("{\"type\":\"btn\",\"data\":{\"down\":false,\"button\":\"%s\"}}", wheel);
+                }
+                break;
+
+            case EV_KEY:
+                if (event->value == 2)
+                    break;
+
+                if (event->code >= BTN_LEFT && event->code <= BTN_MIDDLE) {
+                    qmp_event("{\"type\":\"btn\",\"data\":{\"down\":%s,\"button\":\"%s\"}}",
+                        event->value ? "true" : "false", buttons[event->code - BTN_LEFT]);
+                }
+                else if (qmp_key_number(event->code)) {
+                    qmp_event("{\"type\":\"key\",\"data\":{\"down\":%s,\"key\":{\"type\":\"number\",\"data\":%d}}}",
+                        event->value ? "true" : "false", qmp_key_number(event->code));
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (!count || !qmp_append(buf, size, &len, "]}}\r\n"))
+        return 0;
+
+    return len;
+}
+
+static void qmp_timer_set(struct qmp_connection *qmp, bool armed)
+{
+    struct itimerspec interval = {0};
+
+    if (armed) {
+        interval.it_interval.tv_sec = QMP_RECONNECT_INTERVAL / 1000000;
+        interval.it_interval.tv_nsec = (QMP_RECONNECT_INTERVAL % 1000000) * 1000;
+        interval.it_value = interval.it_interval;
+    }
+
+    if (timerfd_settime(qmp->timer.fd, 0, &interval, NULL) < 0)
+        fprintf(stderr, "Failed to %s QMP reconnect timer: %s\n", armed ? "arm" : "disarm", strerror(errno));
+}
+
+/* Waits for EPOLLOUT only while a send is stalled, epoll would report it on every wait otherwise */
+static void qmp_update(struct qmp_connection *qmp)
+{
+    uint32_t events = EPOLLIN | (qmp->out_len ? EPOLLOUT : 0);
+
+    if (!qmp->v_mk || qmp->fd < 0 || qmp->handler.events == events)
+        return;
+
+    handler_modify(qmp->v_mk, &qmp->handler, events);
+}
+
+static void qmp_disconnect(struct qmp_connection *qmp)
+{
+    fprintf(stderr, "Lost QMP connection %s\n", qmp->path);
+    if (qmp->v_mk) {
+        handler_remove(qmp->v_mk, &qmp->handler);
+        qmp_timer_set(qmp, true);
+    }
+    close(qmp->fd);
+    qmp->fd = -1;
+    /* A half sent command would corrupt the next connection's stream */
+    qmp->out_len = 0;
+}
+
+static void qmp_send(struct qmp_connection *qmp)
+{
+    ssize_t ret;
+
+    while (qmp->out_len) {
+        ret = send(qmp->fd, qmp->out, qmp->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                qmp_disconnect(qmp);
+            return;
+        }
+
+        qmp->out_len -= ret;
+        memmove(qmp->out, qmp->out + ret, qmp->out_len);
+    }
+}
+
+/*
+ * Key and button ups for everything the guest was last sent as held. Key-ups
+ * dropped while the connection was down never reached it, nor did whatever
+ * was still queued when it went. Keys stay marked held until their ups are
+ * queued, when the buffer is full the rest go once the guest reads.
+ */
+static bool qmp_release(struct qmp_connection *qmp)
+{
+    struct input_event events[FRAME_MAX_EVENTS];
+    unsigned int count = 0;
+    size_t len;
+
+    for (unsigned int code = 0; code < KEY_CNT; code++) {
+        if (bit_is_set(qmp->down, code)) {
+            /* Nothing to release for a key the guest was never sent */
+            if ((code < BTN_LEFT || code > BTN_MIDDLE) && !qmp_key_number(code)) {
+                set_bit(qmp->down, code, 0);
+            }
+            else {
+                memset(&events[count], 0, sizeof(events[count]));
+                events[count].type = EV_KEY;
+                events[count].code = code;
+                count++;
+            }
+        }
+
+        if (count && (count == FRAME_MAX_EVENTS || code == KEY_CNT - 1)) {
+            len = qmp_format(events, count, qmp->out + qmp->out_len, sizeof(qmp->out) - qmp->out_len);
+            if (!len) {
+                if (!qmp->releasing)
+                    fprintf(stderr, "QMP %s: no room for key-ups, retrying when the guest reads\n", qmp->path);
+                qmp->releasing = true;
+                return false;
+            }
+
+            qmp->out_len += len;
+            qmp->commands++;
+            for (unsigned int i = 0; i < count; i++)
+                set_bit(qmp->down, events[i].code, 0);
+            count = 0;
+        }
+    }
+
+    qmp->releasing = false;
+    return true;
+}
+
+static int qmp_connect(struct qmp_connection *qmp)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    static const char capabilities[] = "{\"execute\":\"qmp_capabilities\"}\r\n";
+    int fd;
+
+    qmp->last_attempt_us = monotonic_us();
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", qmp->path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -errno;
+    }
+
+    if (qmp->connects++)
+        printf("Reconnected to QMP %s\n", qmp->path);
+    qmp->fd = fd;
+    qmp->error_match = 0;
+
+    /* Pipelined behind the greeting, nothing waits for the server */
+    memcpy(qmp->out, capabilities, sizeof(capabilities) - 1);
+    qmp->out_len = sizeof(capabilities) - 1;
+    qmp_release(qmp);
+
+    if (qmp->v_mk) {
+        qmp_timer_set(qmp, false);
+        qmp->handler.fd = fd;
+        qmp->handler.events = EPOLLIN;
+        handler_add(qmp->v_mk, &qmp->handler);
+        qmp_send(qmp);
+        qmp_update(qmp);
+    }
+
+    return 0;
+}
+
+/* Reads whatever replies arrived without blocking, counting errors */
+static void qmp_drain(struct qmp_connection *qmp)
+{
+    static const char error[] = "\"error\"";
+    char buf[4096];
+    ssize_t ret;
+
+    while ((ret = recv(qmp->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for (ssize_t i = 0; i < ret; i++) {
+            if (buf[i] == '\n')
+                qmp->replies++;
+
+            if (buf[i] == error[qmp->error_match])
+                qmp->error_match++;
+            else
+                qmp->error_match = buf[i] == error[0];
+
+            if (qmp->error_match == sizeof(error) - 1) {
+                qmp->errors++;
+                qmp->error_match = 0;
+            }
+        }
+    }
+
+    if (!ret || (ret < 0 && errno != EAGAIN && errno != EINTR))
+        qmp_disconnect(qmp);
+}
+
+/* Replies and hangups come in as EPOLLIN, EPOLLOUT only while a send is stalled */
+static void dispatch_qmp(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct qmp_connection *qmp = container_of(handler, struct qmp_connection, handler);
+
+    if (qmp->fd < 0)
+        return;
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        qmp_drain(qmp);
+    if (qmp->fd >= 0 && (events & EPOLLOUT)) {
+        qmp_send(qmp);
+        if (qmp->fd >= 0 && qmp->releasing) {
+            qmp_release(qmp);
+            qmp_send(qmp);
+        }
+    }
+    qmp_update(qmp);
+}
+
+/* Armed only while the connection is down */
+static void dispatch_qmp_timer(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct qmp_connection *qmp = container_of(handler, struct qmp_connection, timer);
+    uint64_t expirations;
+
+    if (read(handler->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    if (qmp->fd < 0)
+        qmp_connect(qmp);
+}
+
+int sink_qmp_write(struct output_sink *sink, const struct input_event *events, unsigned int count)
+{
+    struct qmp_connection *qmp = sink->qmp;
+    char command[QMP_COMMAND_SIZE];
+    size_t len;
+
+    /* On the event loop its handlers read replies and reconnect, here only a write can */
+    if (!qmp->v_mk) {
+        if (qmp->fd >= 0)
+            qmp_drain(qmp);
+
+        if (qmp->fd < 0 && monotonic_us() - qmp->last_attempt_us >= QMP_RECONNECT_INTERVAL)
+            qmp_connect(qmp);
+    }
+
+    if (qmp->fd < 0) {
+        qmp->dropped += count;
+        return 0;
+    }
+
+    /* New frames wait behind the key-ups, a key pressed again must not be released after */
+    if (qmp->releasing) {
+        qmp_send(qmp);
+        if (qmp->fd < 0 || !qmp_release(qmp)) {
+            qmp->dropped += count;
+            return -ENOBUFS;
+        }
+    }
+
+    len = qmp_format(events, count, command, sizeof(command));
+    if (!len)
+        return 0;
+
+    /* The guest stopped reading; dropping beats stalling the event loop */
+    if (qmp->out_len + len > sizeof(qmp->out)) {
+        qmp->dropped += count;
+        return -ENOBUFS;
+    }
+
+    memcpy(qmp->out + qmp->out_len, command, len);
+    qmp->out_len += len;
+    qmp->commands++;
+    for (unsigned int i = 0; i < count; i++)
+        if (events[i].type == EV_KEY && events[i].value != 2 && events[i].code < KEY_CNT)
+            set_bit(qmp->down, events[i].code, events[i].value);
+
+    qmp_send(qmp);
+    qmp_update(qmp);
+
+    sink->events += count;
+    return 0;
+}
+
+void qmp_init(struct qmp_connection *qmp, const char *path)
+{
+    int ret;
+
+    memset(qmp, 0, sizeof(*qmp));
+    qmp->path = path;
+    qmp->fd = -1;
+    qmp->timer.fd = -1;
+
+    ret = qmp_connect(qmp);
+    if (ret < 0)
+        fprintf(stderr, "QMP %s not up yet, will retry: %s\n", path, strerror(-ret));
+}
+
+/* Puts the connection on the event loop, from then on it no longer waits for writes */
+int qmp_watch(struct virtual_mk *v_mk, struct qmp_connection *qmp)
+{
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create QMP reconnect timer: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    qmp->v_mk = v_mk;
+    qmp->timer.fd = fd;
+    qmp->timer.dispatch = dispatch_qmp_timer;
+    handler_add(v_mk, &qmp->timer);
+    qmp->handler.dispatch = dispatch_qmp;
+
+    if (qmp->fd < 0) {
+        qmp_timer_set(qmp, true);
+        return 0;
+    }
+
+    qmp->handler.fd = qmp->fd;
+    qmp->handler.events = EPOLLIN;
+    handler_add(v_mk, &qmp->handler);
+    qmp_send(qmp);
+    qmp_update(qmp);
+
+    return 0;
+}
+
+void qmp_close(struct qmp_connection *qmp)
+{
+    printf("QMP %s: %llu commands, %llu replies, %llu errors, %llu reconnects, %llu events dropped\n",
+        qmp->path, (unsigned long long)qmp->commands, (unsigned long long)qmp->replies,
+        (unsigned long long)qmp->errors,
+        (unsigned long long)(qmp->connects ? qmp->connects - 1 : 0),
+        (unsigned long long)qmp->dropped);
+
+    if (qmp->fd >= 0)
+        close(qmp->fd);
+    if (qmp->timer.fd >= 0)
+        close(qmp->timer.fd);
+}
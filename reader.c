@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "virtual_mk.h"
+
+static void reader_compact(struct evdev_reader *reader)
+{
+    if (reader->head) {
+        memmove(reader->events, &reader->events[reader->head],
+            (reader->tail - reader->head) * sizeof(struct input_event));
+        reader->tail -= reader->head;
+        reader->head = 0;
+    }
+}
+
+/*
+ * Returns 1 when the read filled the buffer and more events may be queued
+ * in the kernel, 0 when the fd is drained, or a negative errno. External
+ * readers are filled by reader_push and never read the fd.
+ */
+int reader_fill(struct evdev_reader *reader, int fd)
+{
+    unsigned int space, count;
+    ssize_t ret;
+
+    reader_compact(reader);
+    if (reader->external)
+        return 0;
+
+    space = READER_MAX_EVENTS - reader->tail;
+    if (!space)
+        return 1;
+
+    do {
+        ret = read(fd, &reader->events[reader->tail], space * sizeof(struct input_event));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return errno == EAGAIN ? 0 : -errno;
+
+    count = ret / sizeof(struct input_event);
+    reader->tail += count;
+    reader->reads++;
+    reader->events_read += count;
+
+    return count == space;
+}
+
+/* Events read elsewhere; what does not fit is treated like a kernel SYN_DROPPED */
+void reader_push(struct evdev_reader *reader, const void *data, unsigned int len)
+{
+    unsigned int count = len / sizeof(struct input_event), space;
+
+    reader_compact(reader);
+    space = READER_MAX_EVENTS - reader->tail;
+    if (count > space) {
+        count = space;
+        reader->dropped = true;
+    }
+
+    memcpy(&reader->events[reader->tail], data, count * sizeof(struct input_event));
+    reader->tail += count;
+    reader->events_read += count;
+}
+
+/*
+ * Hands out the next complete frame, including its SYN_REPORT. Frames
+ * between a SYN_DROPPED and the following SYN_REPORT are discarded and
+ * READER_RESYNC is returned so the caller can re-query device state.
+ */
+int reader_next_frame(struct evdev_reader *reader, struct input_event **frame)
+{
+    unsigned int start = reader->head;
+
+    for (unsigned int i = reader->head; i < reader->tail; i++) {
+        struct input_event *event = &reader->events[i];
+
+        if (event->type != EV_SYN)
+            continue;
+
+        if (event->code == SYN_DROPPED) {
+            reader->dropped = true;
+        }
+        else if (event->code == SYN_REPORT) {
+            reader->head = i + 1;
+            if (reader->dropped) {
+                reader->dropped = false;
+                reader->resyncs++;
+                return READER_RESYNC;
+            }
+            *frame = &reader->events[start];
+            return i + 1 - start;
+        }
+    }
+
+    /* Everything up to the SYN_REPORT after a drop is stale */
+    if (reader->dropped) {
+        reader->head = reader->tail;
+        return 0;
+    }
+
+    /* A single frame larger than the buffer, pass it on in pieces */
+    if (start == 0 && reader->tail == READER_MAX_EVENTS) {
+        reader->head = reader->tail;
+        *frame = reader->events;
+        return READER_MAX_EVENTS;
+    }
+
+    return 0;
+}
+
+/*
+ * Discards whatever the kernel has queued. External readers are read
+ * directly too: a suspended device drains before its read is re-armed, so
+ * the stale events would otherwise come in through the ring.
+ */
+void reader_drain(struct evdev_reader *reader, int fd)
+{
+    bool external = reader->external;
+
+    reader->external = false;
+    reader->head = reader->tail = 0;
+    while (reader_fill(reader, fd) > 0)
+        reader->head = reader->tail = 0;
+    reader->head = reader->tail = 0;
+    reader->dropped = false;
+    reader->external = external;
+}
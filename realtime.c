@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+
+#include "config.h"
+#include "virtual_mk.h"
+
+/* Touch the stack the event loop will use so it never page faults later */
+static void __attribute__((noinline)) realtime_prefault_stack(void)
+{
+    volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+/*
+ * Called before the devices are added, so reader threads started for them
+ * inherit SCHED_FIFO and the CPU. MCL_CURRENT locks what exists so far,
+ * MCL_FUTURE covers the devices, libinput and the threads' stacks after.
+ */
+void realtime_setup(struct realtime *realtime)
+{
+    struct sched_param param = { .sched_priority = realtime->priority };
+    cpu_set_t cpus;
+
+    /* --cpu also stands on its own, without the rest of --realtime */
+    realtime->affinity_error = 0;
+    if (realtime->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(realtime->cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            realtime->affinity_error = errno;
+    }
+
+    if (realtime->enabled) {
+        realtime->mlock_error = 0;
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            realtime->mlock_error = errno;
+        realtime_prefault_stack();
+
+        realtime->sched_error = 0;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+            realtime->sched_error = errno;
+    }
+
+    realtime_report(stdout, realtime);
+}
+
+void realtime_report(FILE *out, const struct realtime *realtime)
+{
+    if (!realtime->enabled)
+        fprintf(out, "realtime: off");
+    else
+        fprintf(out, "realtime: SCHED_FIFO %d %s, mlockall %s",
+            realtime->priority,
+            realtime->sched_error ? strerror(realtime->sched_error) : "ok",
+            realtime->mlock_error ? strerror(realtime->mlock_error) : "ok");
+
+    if (realtime->cpu >= 0)
+        fprintf(out, ", cpu %d %s", realtime->cpu,
+            realtime->affinity_error ? strerror(realtime->affinity_error) : "ok");
+    fprintf(out, "\n");
+}
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "virtual_mk.h"
+
+static inline bool byte_bit_is_set(const uint8_t *array, unsigned int bit)
+{
+    return array[bit / 8] & (1 << (bit % 8));
+}
+
+static void record_describe(struct libevdev *dev, struct record_device *desc)
+{
+    const struct input_absinfo *absinfo;
+
+    memset(desc, 0, sizeof(*desc));
+    snprintf(desc->name, sizeof(desc->name), "%s", libevdev_get_name(dev));
+    desc->id.bustype = libevdev_get_id_bustype(dev);
+    desc->id.vendor = libevdev_get_id_vendor(dev);
+    desc->id.product = libevdev_get_id_product(dev);
+    desc->id.version = libevdev_get_id_version(dev);
+
+    for (unsigned int code = 0; code < KEY_CNT; code++)
+        if (libevdev_has_event_code(dev, EV_KEY, code))
+            desc->key_bits[code / 8] |= 1 << (code % 8);
+
+    for (unsigned int code = 0; code < REL_CNT; code++)
+        if (libevdev_has_event_code(dev, EV_REL, code))
+            desc->rel_bits[code / 8] |= 1 << (code % 8);
+
+    for (unsigned int code = 0; code < MSC_CNT; code++)
+        if (libevdev_has_event_code(dev, EV_MSC, code))
+            desc->msc_bits[code / 8] |= 1 << (code % 8);
+
+    for (unsigned int prop = 0; prop < INPUT_PROP_CNT; prop++)
+        if (libevdev_has_property(dev, prop))
+            desc->prop_bits[prop / 8] |= 1 << (prop % 8);
+
+    for (unsigned int code = 0; code < ABS_CNT; code++) {
+        if (!libevdev_has_event_code(dev, EV_ABS, code))
+            continue;
+
+        desc->abs_bits[code / 8] |= 1 << (code % 8);
+        absinfo = libevdev_get_abs_info(dev, code);
+        if (absinfo)
+            desc->absinfo[code] = *absinfo;
+    }
+}
+
+static int record_clone(const struct record_device *desc, const char *suffix,
+    struct libevdev_uinput **clone)
+{
+    char name[RECORD_NAME_SIZE + 32];
+    struct libevdev *dev = libevdev_new();
+    int ret;
+
+    snprintf(name, sizeof(name), "%s (%s)", desc->name, suffix);
+    libevdev_set_name(dev, name);
+    libevdev_set_id_bustype(dev, desc->id.bustype);
+    libevdev_set_id_vendor(dev, desc->id.vendor);
+    libevdev_set_id_product(dev, desc->id.product);
+    libevdev_set_id_version(dev, desc->id.version);
+
+    for (unsigned int code = 0; code < KEY_CNT; code++)
+        if (byte_bit_is_set(desc->key_bits, code))
+            libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+
+    for (unsigned int code = 0; code < REL_CNT; code++)
+        if (byte_bit_is_set(desc->rel_bits, code))
+            libevdev_enable_event_code(dev, EV_REL, code, NULL);
+
+    for (unsigned int code = 0; code < MSC_CNT; code++)
+        if (byte_bit_is_set(desc->msc_bits, code))
+            libevdev_enable_event_code(dev, EV_MSC, code, NULL);
+
+    for (unsigned int prop = 0; prop < INPUT_PROP_CNT; prop++)
+        if (byte_bit_is_set(desc->prop_bits, prop))
+            libevdev_enable_property(dev, prop);
+
+    for (unsigned int code = 0; code < ABS_CNT; code++)
+        if (byte_bit_is_set(desc->abs_bits, code))
+            libevdev_enable_event_code(dev, EV_ABS, code, &desc->absinfo[code]);
+
+    ret = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, clone);
+    if (ret < 0)
+        fprintf(stderr, "Failed to create clone of %s: %s\n", desc->name, strerror(-ret));
+
+    libevdev_free(dev);
+    return ret;
+}
+
+static int record_describe_path(const char *path, struct record_device *desc)
+{
+    struct libevdev *dev;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    ret = libevdev_new_from_fd(fd, &dev);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to init libevdev for %s: %s\n", path, strerror(-ret));
+        close(fd);
+        return ret;
+    }
+
+    record_describe(dev, desc);
+    libevdev_free(dev);
+    close(fd);
+
+    return 0;
+}
+
+int recorder_open(struct recorder *recorder, const char *path, const char *touchpad, const char *keyboard)
+{
+    struct record_device devices[RECORD_SOURCE_MAX];
+    uint32_t version = RECORD_VERSION;
+    int ret;
+
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->tap_fd = -1;
+
+    ret = record_describe_path(keyboard, &devices[RECORD_KEYBOARD]);
+    if (ret < 0)
+        return ret;
+
+    recorder->tap_fd = open(touchpad, O_RDONLY | O_NONBLOCK);
+    if (recorder->tap_fd < 0) {
+        fprintf(stderr, "Failed to open touchpad %s: %s\n", touchpad, strerror(errno));
+        return -errno;
+    }
+
+    ret = libevdev_new_from_fd(recorder->tap_fd, &recorder->tap_evdev);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to init libevdev for touchpad: %s\n", strerror(-ret));
+        goto err_evdev;
+    }
+    libevdev_set_clock_id(recorder->tap_evdev, CLOCK_MONOTONIC);
+    record_describe(recorder->tap_evdev, &devices[RECORD_TOUCHPAD]);
+
+    ret = record_clone(&devices[RECORD_TOUCHPAD], "virtual_mk record", &recorder->clone);
+    if (ret < 0)
+        goto err_clone;
+
+    recorder->file = fopen(path, "wb");
+    if (!recorder->file) {
+        fprintf(stderr, "Failed to open recording %s: %s\n", path, strerror(errno));
+        ret = -errno;
+        goto err_file;
+    }
+
+    if (fwrite(RECORD_MAGIC, 4, 1, recorder->file) != 1 ||
+        fwrite(&version, sizeof(version), 1, recorder->file) != 1 ||
+        fwrite(devices, sizeof(devices), 1, recorder->file) != 1) {
+        fprintf(stderr, "Failed to write recording header: %s\n", strerror(errno));
+        ret = -EIO;
+        goto err_header;
+    }
+
+    /* The clone stands in for the touchpad, host included, from here on */
+    libevdev_grab(recorder->tap_evdev, LIBEVDEV_GRAB);
+
+    return 0;
+
+err_header:
+    fclose(recorder->file);
+err_file:
+    libevdev_uinput_destroy(recorder->clone);
+err_clone:
+    libevdev_free(recorder->tap_evdev);
+err_evdev:
+    close(recorder->tap_fd);
+    recorder->tap_fd = -1;
+    return ret;
+}
+
+const char *recorder_touchpad_devnode(struct recorder *recorder)
+{
+    return libevdev_uinput_get_devnode(recorder->clone);
+}
+
+void recorder_write(struct recorder *recorder, enum record_source source,
+    const struct input_event *events, int count)
+{
+    struct record_event records[READER_MAX_EVENTS];
+    uint64_t time_us = event_time_us(&events[count - 1]);
+    struct record_frame frame = {
+        .delta_us = recorder->last_us && time_us > recorder->last_us ? time_us - recorder->last_us : 0,
+        .source = source,
+        .count = count,
+    };
+
+    for (int i = 0; i < count; i++) {
+        records[i].type = events[i].type;
+        records[i].code = events[i].code;
+        records[i].value = events[i].value;
+    }
+
+    fwrite(&frame, sizeof(frame), 1, recorder->file);
+    fwrite(records, sizeof(records[0]), count, recorder->file);
+
+    recorder->last_us = time_us;
+    recorder->frames++;
+}
+
+void recorder_handle_events(struct recorder *recorder)
+{
+    int clone_fd = libevdev_uinput_get_fd(recorder->clone);
+    struct input_event *events;
+    int count, more;
+
+    do {
+        more = reader_fill(&recorder->reader, recorder->tap_fd);
+        if (more < 0) {
+            fprintf(stderr, "Failed to read touchpad: %s\n", strerror(-more));
+            break;
+        }
+
+        while ((count = reader_next_frame(&recorder->reader, &events)) != 0) {
+            if (count == READER_RESYNC)
+                continue;
+
+            recorder_write(recorder, RECORD_TOUCHPAD, events, count);
+            if (write(clone_fd, events, count * sizeof(struct input_event)) < 0)
+                fprintf(stderr, "Failed to mirror touchpad frame: %s\n", strerror(errno));
+        }
+    } while (more);
+}
+
+void recorder_close(struct recorder *recorder)
+{
+    printf("Recorded %llu frames\n", (unsigned long long)recorder->frames);
+    fclose(recorder->file);
+    libevdev_grab(recorder->tap_evdev, LIBEVDEV_UNGRAB);
+    libevdev_uinput_destroy(recorder->clone);
+    libevdev_free(recorder->tap_evdev);
+    close(recorder->tap_fd);
+}
+
+int replay_open(struct replay *replay, const char *path)
+{
+    char magic[4];
+    uint32_t version;
+    int source, ret;
+
+    memset(replay, 0, sizeof(*replay));
+
+    replay->file = fopen(path, "rb");
+    if (!replay->file) {
+        fprintf(stderr, "Failed to open recording %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    if (fread(magic, sizeof(magic), 1, replay->file) != 1 ||
+        fread(&version, sizeof(version), 1, replay->file) != 1 ||
+        fread(replay->devices, sizeof(replay->devices), 1, replay->file) != 1 ||
+        memcmp(magic, RECORD_MAGIC, sizeof(magic)) || version != RECORD_VERSION) {
+        fprintf(stderr, "%s is not a virtual_mk recording\n", path);
+        ret = -EINVAL;
+        goto err_header;
+    }
+
+    for (source = 0; source < RECORD_SOURCE_MAX; source++) {
+        ret = record_clone(&replay->devices[source], "virtual_mk replay", &replay->clones[source]);
+        if (ret < 0)
+            goto err_clone;
+    }
+
+    return 0;
+
+err_clone:
+    while (--source >= 0)
+        libevdev_uinput_destroy(replay->clones[source]);
+err_header:
+    fclose(replay->file);
+    return ret;
+}
+
+const char *replay_devnode(struct replay *replay, enum record_source source)
+{
+    return libevdev_uinput_get_devnode(replay->clones[source]);
+}
+
+/*
+ * Loads the next frame into replay->events and advances replay->time_us
+ * by its recorded delay. Returns the event count, 0 at the end of file.
+ */
+int replay_next(struct replay *replay, enum record_source *source)
+{
+    struct record_event records[READER_MAX_EVENTS];
+    struct record_frame frame;
+
+    if (fread(&frame, sizeof(frame), 1, replay->file) != 1)
+        return 0;
+
+    if (frame.source >= RECORD_SOURCE_MAX || !frame.count || frame.count > READER_MAX_EVENTS ||
+        fread(records, sizeof(records[0]), frame.count, replay->file) != frame.count) {
+        fprintf(stderr, "Truncated or corrupt recording\n");
+        return 0;
+    }
+
+    for (int i = 0; i < frame.count; i++) {
+        replay->events[i].type = records[i].type;
+        replay->events[i].code = records[i].code;
+        replay->events[i].value = records[i].value;
+    }
+
+    replay->time_us += frame.delta_us;
+    *source = frame.source;
+
+    return frame.count;
+}
+
+int replay_inject(struct replay *replay, enum record_source source, int count)
+{
+    int fd = libevdev_uinput_get_fd(replay->clones[source]);
+
+    if (write(fd, replay->events, count * sizeof(struct input_event)) < 0) {
+        fprintf(stderr, "Failed to inject replayed frame: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+void replay_close(struct replay *replay)
+{
+    for (int source = 0; source < RECORD_SOURCE_MAX; source++)
+        libevdev_uinput_destroy(replay->clones[source]);
+    fclose(replay->file);
+}
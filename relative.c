@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "virtual_mk.h"
+
+/* REL_X/REL_Y and no absolute axes: a mouse, not a touchpad. A throwaway fd, grabs stay as they are */
+bool relative_probe(const char *path)
+{
+    unsigned long rel[NLONGS(REL_CNT)] = {0};
+    unsigned long abs[NLONGS(ABS_CNT)] = {0};
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    ioctl(fd, EVIOCGBIT(EV_REL, sizeof(rel)), rel);
+    ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs);
+    close(fd);
+
+    return bit_is_set(rel, REL_X) && bit_is_set(rel, REL_Y) &&
+        !bit_is_set(abs, ABS_X) && !bit_is_set(abs, ABS_MT_POSITION_X);
+}
+
+/* Scales in place in the reader buffer, the remainder carries over in the motion accumulator */
+static int relative_scale(struct virtual_mouse *mouse, struct input_event *event)
+{
+    double *remainder = event->code == REL_X ? &mouse->motion.x : &mouse->motion.y;
+    double value = event->value * mouse->rel_scale + *remainder;
+
+    event->value = (int)value;
+    *remainder = value - event->value;
+    return event->value;
+}
+
+/*
+ * Walks one frame for what the copy needs: held buttons for release on a
+ * target switch, scaled motion, and the latency class. Returns false for
+ * a frame that scaling left empty.
+ */
+static bool relative_frame(struct virtual_mouse *mouse, struct input_event *events, int count, bool scaled)
+{
+    enum stat_class class = STAT_MOTION;
+    bool moved = !scaled;
+
+    for (int i = 0; i < count; i++) {
+        struct input_event *event = &events[i];
+
+        if (event->type == EV_KEY && event->code >= BTN_LEFT && event->code <= BTN_EXTRA) {
+            if (event->value)
+                mouse->buttons |= 1 << (event->code - BTN_LEFT);
+            else
+                mouse->buttons &= ~(1 << (event->code - BTN_LEFT));
+            class = STAT_BUTTON;
+            moved = true;
+        }
+        else if (event->type == EV_REL && (event->code == REL_X || event->code == REL_Y)) {
+            if (scaled && relative_scale(mouse, event))
+                moved = true;
+        }
+        else if (event->type == EV_REL) {
+            class = class == STAT_BUTTON ? class : STAT_SCROLL;
+            moved = true;
+        }
+    }
+
+    if (moved)
+        frame_mark(&mouse->frame, class, event_time_us(&events[count - 1]));
+    return moved;
+}
+
+/* After SYN_DROPPED: motion lost is lost, held buttons are put right from the kernel's state */
+static void relative_sync(struct virtual_mouse *mouse)
+{
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+    bool changed = false;
+
+    if (ioctl(mouse->evdev_fd, EVIOCGKEY(sizeof(key_state)), key_state) < 0)
+        return;
+
+    for (uint32_t button = BTN_LEFT; button <= BTN_EXTRA; button++) {
+        unsigned int bit = 1 << (button - BTN_LEFT);
+        bool down = bit_is_set(key_state, button);
+
+        if (down == !!(mouse->buttons & bit))
+            continue;
+
+        frame_write(&mouse->frame, EV_KEY, button, down);
+        mouse->buttons ^= bit;
+        changed = true;
+    }
+
+    if (changed)
+        frame_sync(&mouse->frame);
+}
+
+/*
+ * The source is already what the virtual mouse sends, so frames are
+ * copied as read: runs of frames back to back in the reader buffer go out
+ * in one write straight from it, ending before each refill that may move
+ * it. Codes the virtual mouse does not advertise are dropped by uinput.
+ */
+void relative_handle_events(struct virtual_mouse *mouse)
+{
+    struct input_event *events, *run = NULL;
+    uint64_t events_read = mouse->reader.events_read;
+    bool scaled = mouse->rel_scale > 0 && mouse->rel_scale != 1.0;
+    unsigned int run_count = 0;
+    int count, more;
+
+    do {
+        more = reader_fill(&mouse->reader, mouse->evdev_fd);
+        if (more < 0) {
+            fprintf(stderr, "Failed to read mouse: %s\n", strerror(-more));
+            break;
+        }
+
+        while ((count = reader_next_frame(&mouse->reader, &events)) != 0) {
+            if (!mouse->grabbed)
+                continue;
+
+            if (count == READER_RESYNC) {
+                frame_pass(&mouse->frame, run, run_count);
+                run_count = 0;
+                relative_sync(mouse);
+                continue;
+            }
+
+            if (run_count && events != run + run_count) {
+                frame_pass(&mouse->frame, run, run_count);
+                run_count = 0;
+            }
+
+            if (!relative_frame(mouse, events, count, scaled))
+                continue;
+
+            if (!run_count)
+                run = events;
+            run_count += count;
+        }
+
+        frame_pass(&mouse->frame, run, run_count);
+        run_count = 0;
+    } while (more);
+
+    /* A resync with nothing after it is still queued */
+    frame_flush(&mouse->frame);
+
+    mouse->stats.wakeups++;
+    hist_add(&mouse->stats.batch, mouse->reader.events_read - events_read);
+}
+
+/* Buttons were released on ungrab, the ones still held go out again from the kernel's state */
+void relative_resume(struct virtual_mouse *mouse)
+{
+    reader_drain(&mouse->reader, mouse->evdev_fd);
+    relative_sync(mouse);
+    frame_flush(&mouse->frame);
+}
+
+int relative_create(const char *path, struct virtual_mouse *mouse)
+{
+    int clock = CLOCK_MONOTONIC;
+    int fd;
+
+    fd = handover_open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open mouse %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+
+    mouse->evdev_fd = fd;
+    mouse->fd = fd;
+    memset(&mouse->reader, 0, sizeof(mouse->reader));
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+#include "virtual_mk.h"
+
+static void scheduler_set(struct output_scheduler *scheduler, bool armed)
+{
+    struct itimerspec interval = {0};
+    uint64_t period_ns = 1000000000ULL / scheduler->rate;
+
+    if (armed) {
+        interval.it_interval.tv_sec = period_ns / 1000000000ULL;
+        interval.it_interval.tv_nsec = period_ns % 1000000000ULL;
+        interval.it_value = interval.it_interval;
+    }
+
+    if (timerfd_settime(scheduler->handler.fd, 0, &interval, NULL) < 0) {
+        fprintf(stderr, "Failed to %s scheduler timer: %s\n", armed ? "arm" : "disarm", strerror(errno));
+        return;
+    }
+    scheduler->armed = armed;
+}
+
+/* Called when a paced touchpad leaves motion or scroll pending; the first one starts the ticks */
+void scheduler_arm(struct output_scheduler *scheduler)
+{
+    if (!scheduler->armed)
+        scheduler_set(scheduler, true);
+}
+
+/*
+ * One read per tick; missed expirations are not made up, the next flush
+ * carries everything. A tick that flushes nothing stops the timer, so an
+ * idle or ungrabbed touchpad costs no wakeups.
+ */
+static void dispatch_scheduler(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct output_scheduler *scheduler = container_of(handler, struct output_scheduler, handler);
+    uint64_t expirations, flushes = scheduler->flushes;
+
+    if (read(handler->fd, &expirations, sizeof(expirations)) < 0)
+        return;
+    scheduler->ticks++;
+
+    for (struct input_device *device = v_mk->devices; device; device = device->next) {
+        struct virtual_mouse *mouse = &device->mouse;
+
+        if (device->removed || device->kind != DEVICE_TOUCHPAD || !mouse->scheduler)
+            continue;
+
+        if (!mouse->motion.pending && !mouse->scroll.pending)
+            continue;
+
+        mouse_flush(mouse);
+        frame_flush(&mouse->frame);
+        scheduler->flushes++;
+    }
+
+    if (scheduler->flushes == flushes)
+        scheduler_set(scheduler, false);
+}
+
+int scheduler_init(struct virtual_mk *v_mk, unsigned int rate)
+{
+    struct output_scheduler *scheduler = &v_mk->scheduler;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create scheduler timer: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    /* Left disarmed until a touchpad has something to flush */
+    scheduler->handler.fd = fd;
+    scheduler->handler.dispatch = dispatch_scheduler;
+    scheduler->rate = rate;
+    scheduler->armed = false;
+    handler_add(v_mk, &scheduler->handler);
+
+    return 0;
+}
+
+void scheduler_report(FILE *out, struct output_scheduler *scheduler)
+{
+    fprintf(out, "scheduler %u Hz: %llu ticks, %llu flushes\n", scheduler->rate,
+        (unsigned long long)scheduler->ticks, (unsigned long long)scheduler->flushes);
+}
+
+void scheduler_close(struct virtual_mk *v_mk)
+{
+    if (!v_mk->scheduler.rate)
+        return;
+
+    close(v_mk->scheduler.handler.fd);
+    v_mk->scheduler.rate = 0;
+}
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "virtual_mk.h"
+
+static const char *class_names[STAT_CLASS_MAX] = {
+    [STAT_MOTION] = "motion",
+    [STAT_BUTTON] = "button",
+    [STAT_SCROLL] = "scroll",
+    [STAT_KEY] = "key",
+    [STAT_GRAB] = "grab",
+    [STAT_TAP] = "tap",
+};
+
+static inline unsigned int hist_bucket(uint64_t value)
+{
+    unsigned int msb, index;
+
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    msb = 63 - __builtin_clzll(value);
+    index = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+        ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Smallest value that lands in the bucket */
+static inline uint64_t hist_bucket_floor(unsigned int index)
+{
+    unsigned int group = index >> HIST_SUB_BITS;
+
+    if (!group)
+        return index;
+
+    return (uint64_t)(HIST_SUB_BUCKETS + (index & (HIST_SUB_BUCKETS - 1))) << (group - 1);
+}
+
+void hist_add(struct latency_hist *hist, uint64_t value)
+{
+    hist->counts[hist_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/* Upper edge of the bucket holding the percentile, capped at the max seen */
+uint64_t hist_percentile(const struct latency_hist *hist, double percentile)
+{
+    uint64_t rank, seen = 0;
+
+    if (!hist->total)
+        return 0;
+
+    rank = (uint64_t)(percentile / 100.0 * (double)hist->total);
+    if (rank >= hist->total)
+        rank = hist->total - 1;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            uint64_t edge = i + 1 < HIST_BUCKETS ? hist_bucket_floor(i + 1) - 1 : hist->max;
+            return edge < hist->max ? edge : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+const char *stat_class_name(enum stat_class class)
+{
+    return class_names[class];
+}
+
+int stats_listen(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open stats socket: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -errno;
+    }
+
+    return fd;
+}
+
+static void stats_dump_device(FILE *out, struct device_stats *stats, double uptime, double interval)
+{
+    fprintf(out, "%s: wakeups %llu recent %.1f/s batch p50 %llu p99 %llu max %llu\n", stats->name,
+        (unsigned long long)stats->wakeups,
+        interval > 0 ? (stats->wakeups - stats->last_wakeups) / interval : 0,
+        (unsigned long long)hist_percentile(&stats->batch, 50),
+        (unsigned long long)hist_percentile(&stats->batch, 99),
+        (unsigned long long)stats->batch.max);
+
+    if (stats->merged.total)
+        fprintf(out, "  merged events per flush p50 %llu p99 %llu max %llu\n",
+            (unsigned long long)hist_percentile(&stats->merged, 50),
+            (unsigned long long)hist_percentile(&stats->merged, 99),
+            (unsigned long long)stats->merged.max);
+
+    for (int class = 0; class < STAT_CLASS_MAX; class++) {
+        struct latency_hist *hist = &stats->latency[class];
+        uint64_t recent = stats->events[class] - stats->last_events[class];
+
+        if (!stats->events[class])
+            continue;
+
+        fprintf(out, "  %-6s events %llu rate %.1f/s recent %.1f/s latency_us p50 %llu p99 %llu p99.9 %llu max %llu\n",
+            class_names[class], (unsigned long long)stats->events[class],
+            uptime > 0 ? stats->events[class] / uptime : 0,
+            interval > 0 ? recent / interval : 0,
+            (unsigned long long)hist_percentile(hist, 50),
+            (unsigned long long)hist_percentile(hist, 99),
+            (unsigned long long)hist_percentile(hist, 99.9),
+            (unsigned long long)hist->max);
+
+        stats->last_events[class] = stats->events[class];
+    }
+    stats->last_wakeups = stats->wakeups;
+}
+
+void stats_serve(struct virtual_mk *v_mk)
+{
+    static uint64_t last_dump_us;
+    uint64_t now = monotonic_us();
+    double uptime, interval;
+    FILE *out;
+    int fd;
+
+    while ((fd = accept4(v_mk->stats_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        out = fdopen(fd, "w");
+        if (!out) {
+            close(fd);
+            continue;
+        }
+
+        uptime = (now - v_mk->start_us) / 1e6;
+        interval = (now - (last_dump_us ? last_dump_us : v_mk->start_us)) / 1e6;
+
+        fprintf(out, "uptime %.1fs\n", uptime);
+        if (v_mk->realtime)
+            realtime_report(out, v_mk->realtime);
+        fprintf(out, "accel %s\n", accel_curve());
+        keymap_report(out, v_mk->keymap);
+        stats_loop_report(out, v_mk);
+        for (struct input_device *device = v_mk->devices; device; device = device->next) {
+            if (device->removed)
+                continue;
+            stats_dump_device(out, device->kind == DEVICE_KEYBOARD ?
+                &device->keyboard.stats : &device->mouse.stats, uptime, interval);
+            if (device->kind == DEVICE_KEYBOARD)
+                keyboard_report(out, &device->keyboard);
+            if (device->kind == DEVICE_TOUCHPAD && device->mouse.suspended)
+                fprintf(out, "  suspended\n");
+            if (device->thread)
+                thread_report(out, device->thread);
+        }
+        fclose(out);
+
+        last_dump_us = now;
+    }
+}
+
+/*
+ * Loop wakeups, evdev reads and uinput writes per forwarded frame. Reads
+ * libinput does on its own fd are not visible here.
+ */
+void stats_loop_report(FILE *out, struct virtual_mk *v_mk)
+{
+    uint64_t syscalls = v_mk->loop_waits + v_mk->scheduler.ticks, frames = 0;
+
+    for (struct input_device *device = v_mk->devices; device; device = device->next)
+        syscalls += device->kind == DEVICE_KEYBOARD ? device->keyboard.reader.reads : device->mouse.reader.reads;
+
+    if (v_mk->recorder)
+        syscalls += v_mk->recorder->reader.reads;
+
+    for (int i = 0; i < v_mk->output_count; i++) {
+        syscalls += v_mk->outputs[i].mouse_sink.syscalls + v_mk->outputs[i].keyboard_sink.syscalls;
+        frames += v_mk->outputs[i].mouse_sink.frames + v_mk->outputs[i].keyboard_sink.frames;
+    }
+
+    fprintf(out, "loop %s: %llu syscalls for %llu frames, %.2f per frame\n",
+        v_mk->uring ? "io_uring" : "epoll", (unsigned long long)syscalls, (unsigned long long)frames,
+        frames ? (double)syscalls / frames : 0);
+    if (v_mk->scheduler.rate)
+        scheduler_report(out, &v_mk->scheduler);
+}
+
+void stats_close(struct virtual_mk *v_mk)
+{
+    if (v_mk->stats_fd < 0)
+        return;
+
+    close(v_mk->stats_fd);
+    unlink(v_mk->stats_path);
+}
@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "virtual_mk.h"
+
+static void writer_wake(struct thread_writer *writer)
+{
+    uint64_t value = 1;
+
+    /* Only the first frame after a drain pays for the eventfd write */
+    if (!atomic_exchange(&writer->pending, true))
+        if (write(writer->wake_fd, &value, sizeof(value)) < 0)
+            fprintf(stderr, "Failed to wake writer: %s\n", strerror(errno));
+}
+
+void thread_wake(struct device_thread *thread)
+{
+    uint64_t value = 1;
+
+    if (write(thread->wake_fd, &value, sizeof(value)) < 0)
+        fprintf(stderr, "Failed to wake reader thread: %s\n", strerror(errno));
+}
+
+/*
+ * The frame sink of a threaded device. Runs on the reader thread: copies
+ * the frame into the ring together with the output it is meant for, and
+ * waits for the writer when the ring is full rather than dropping input.
+ * The frame's latency samples move into the slot, so the clock stops at
+ * the writer's uinput write as in every other mode, not at the push.
+ */
+int sink_ring_write(struct output_sink *sink, const struct input_event *events, unsigned int count)
+{
+    struct device_thread *thread = container_of(sink, struct device_thread, ring_sink);
+    struct input_device *device = thread->device;
+    struct output_frame *frame = device->kind == DEVICE_KEYBOARD ? &device->keyboard.frame : &device->mouse.frame;
+    struct spsc_ring *ring = &thread->ring;
+    struct ring_frame *slot;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t depth;
+    bool stalled = false;
+
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+        if (atomic_load(&thread->stop))
+            return -EPIPE;
+
+        if (!stalled) {
+            atomic_fetch_add_explicit(&ring->stalls, 1, memory_order_relaxed);
+            stalled = true;
+        }
+        writer_wake(thread->v_mk->threads);
+        sched_yield();
+    }
+
+    slot = &ring->frames[tail % RING_SIZE];
+    memcpy(slot->events, events, count * sizeof(struct input_event));
+    slot->count = count;
+    slot->sink = device->kind == DEVICE_KEYBOARD ? &device->output->keyboard_sink : &device->output->mouse_sink;
+    slot->urgent = false;
+    for (unsigned int i = 0; i < count; i++)
+        slot->urgent |= events[i].type == EV_KEY;
+
+    slot->stats = frame->stats;
+    slot->sample_count = frame->sample_count;
+    memcpy(slot->samples, frame->samples, frame->sample_count * sizeof(struct frame_sample));
+    frame->sample_count = 0;
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    depth = tail + 1 - atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&ring->max_depth, memory_order_relaxed))
+        atomic_store_explicit(&ring->max_depth, depth, memory_order_relaxed);
+
+    sink->events += count;
+    writer_wake(thread->v_mk->threads);
+    return 0;
+}
+
+/* Writes the oldest frame of a ring, only_urgent leaves motion for later */
+static bool ring_pop(struct spsc_ring *ring, bool only_urgent)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct ring_frame *slot;
+
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+        return false;
+
+    slot = &ring->frames[head % RING_SIZE];
+    if (only_urgent && !slot->urgent)
+        return false;
+
+    slot->sink->write(slot->sink, slot->events, slot->count);
+    if (slot->sample_count)
+        frame_record_samples(slot->stats, slot->samples, slot->sample_count);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+/*
+ * Drains every ring on the main thread. Rings whose next frame carries
+ * keys or buttons go first; motion is then taken one frame per ring at a
+ * time. Frames within a ring always keep their order.
+ */
+static void dispatch_rings(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct thread_writer *writer = container_of(handler, struct thread_writer, handler);
+    struct input_device *device;
+    uint64_t value;
+    bool progress;
+
+    if (read(writer->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Failed to read writer wakeup: %s\n", strerror(errno));
+    atomic_store(&writer->pending, false);
+
+    do {
+        progress = false;
+
+        for (device = v_mk->devices; device; device = device->next)
+            if (device->thread)
+                while (ring_pop(&device->thread->ring, true))
+                    progress = true;
+
+        for (device = v_mk->devices; device; device = device->next)
+            if (device->thread && ring_pop(&device->thread->ring, false))
+                progress = true;
+    } while (progress);
+
+    for (device = v_mk->devices; device; device = device->next)
+        if (device->thread && atomic_load(&device->thread->lost))
+            device_remove(v_mk, device);
+}
+
+static void *thread_main(void *data)
+{
+    struct device_thread *thread = data;
+    struct input_device *device = thread->device;
+    struct pollfd fds[2] = {
+        { .fd = device->handler.fd, .events = POLLIN },
+        { .fd = thread->wake_fd, .events = POLLIN },
+    };
+    uint64_t value;
+
+    while (!atomic_load(&thread->stop)) {
+        device_sync(thread->v_mk, device);
+        /* poll skips negative fds, an idle touchpad costs this thread no wakeups */
+        fds[0].fd = device_idle(device) ? -1 : device->handler.fd;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Reader thread for %s failed: %s\n", device->name, strerror(errno));
+            break;
+        }
+
+        if ((fds[1].revents & POLLIN) && read(thread->wake_fd, &value, sizeof(value)) < 0)
+            continue;
+
+        /* Removal is the main thread's job, hand the device back to it */
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            atomic_store(&thread->lost, true);
+            writer_wake(thread->v_mk->threads);
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            device->handler.dispatch(thread->v_mk, &device->handler, EPOLLIN);
+    }
+
+    return NULL;
+}
+
+int threads_init(struct virtual_mk *v_mk)
+{
+    struct thread_writer *writer;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return -ENOMEM;
+
+    writer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer->wake_fd < 0) {
+        fprintf(stderr, "Failed to create writer eventfd: %s\n", strerror(errno));
+        free(writer);
+        return -errno;
+    }
+
+    writer->handler.fd = writer->wake_fd;
+    writer->handler.dispatch = dispatch_rings;
+    v_mk->threads = writer;
+    handler_add(v_mk, &writer->handler);
+
+    return 0;
+}
+
+int thread_start(struct virtual_mk *v_mk, struct input_device *device)
+{
+    struct device_thread *thread;
+    struct output_frame *frame;
+    int ret;
+
+    thread = calloc(1, sizeof(*thread));
+    if (!thread)
+        return -ENOMEM;
+
+    thread->device = device;
+    thread->v_mk = v_mk;
+    thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->wake_fd < 0) {
+        ret = -errno;
+        goto err_eventfd;
+    }
+
+    sink_init(&thread->ring_sink, SINK_RING, -1);
+    frame = device->kind == DEVICE_KEYBOARD ? &device->keyboard.frame : &device->mouse.frame;
+    frame->sink = &thread->ring_sink;
+    device->thread = thread;
+
+    ret = -pthread_create(&thread->thread, NULL, thread_main, thread);
+    if (ret < 0)
+        goto err_thread;
+
+    return 0;
+
+err_thread:
+    device->thread = NULL;
+    frame->sink = device->kind == DEVICE_KEYBOARD ? &device->output->keyboard_sink : &device->output->mouse_sink;
+    close(thread->wake_fd);
+err_eventfd:
+    fprintf(stderr, "Failed to start reader thread for %s: %s\n", device->name, strerror(-ret));
+    free(thread);
+    return ret;
+}
+
+/* Joins the reader and flushes what it queued, the device is single threaded again after */
+void thread_stop(struct virtual_mk *v_mk, struct input_device *device)
+{
+    struct device_thread *thread = device->thread;
+
+    atomic_store(&thread->stop, true);
+    thread_wake(thread);
+    pthread_join(thread->thread, NULL);
+
+    while (ring_pop(&thread->ring, false))
+        ;
+
+    if (device->kind == DEVICE_KEYBOARD)
+        device->keyboard.frame.sink = &device->output->keyboard_sink;
+    else
+        device->mouse.frame.sink = &device->output->mouse_sink;
+
+    close(thread->wake_fd);
+    free(thread);
+    device->thread = NULL;
+}
+
+void thread_report(FILE *out, struct device_thread *thread)
+{
+    struct spsc_ring *ring = &thread->ring;
+
+    fprintf(out, "  ring depth %u max %u stalls %llu\n",
+        atomic_load(&ring->tail) - atomic_load(&ring->head), atomic_load(&ring->max_depth),
+        (unsigned long long)atomic_load(&ring->stalls));
+}
+
+void threads_close(struct virtual_mk *v_mk)
+{
+    if (!v_mk->threads)
+        return;
+
+    close(v_mk->threads->wake_fd);
+    free(v_mk->threads);
+    v_mk->threads = NULL;
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""
+A stand-in for QEMU's QMP socket to try the qmp sink without a guest:
+sends the greeting, answers every command with an empty return and
+prints the input-send-event ones. Ctrl-C and a restart exercise the
+sink's reconnect and key release.
+
+  tools/qmp_stub.py /tmp/vm.qmp
+  sudo virtual_mk --sink qmp --qmp /tmp/vm.qmp ...
+"""
+
+import json
+import os
+import socket
+import sys
+
+GREETING = {"QMP": {"version": {"qemu": {"major": 8, "minor": 2, "micro": 0}, "package": ""},
+                    "capabilities": []}}
+
+
+def serve(conn):
+    conn.sendall(json.dumps(GREETING).encode() + b"\r\n")
+    buf = b""
+    while True:
+        data = conn.recv(65536)
+        if not data:
+            return
+        buf += data
+        while b"\n" in buf:
+            line, buf = buf.split(b"\n", 1)
+            if not line.strip():
+                continue
+            try:
+                command = json.loads(line)
+            except ValueError:
+                conn.sendall(b'{"error": {"class": "GenericError", "desc": "Invalid JSON"}}\r\n')
+                continue
+            if command.get("execute") == "input-send-event":
+                for event in command["arguments"]["events"]:
+                    print(event["type"], json.dumps(event["data"], separators=(",", ":")))
+                sys.stdout.flush()
+            conn.sendall(b'{"return": {}}\r\n')
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: %s SOCKET" % sys.argv[0])
+
+    path = sys.argv[1]
+    if os.path.exists(path):
+        os.unlink(path)
+
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.bind(path)
+    server.listen(1)
+    try:
+        while True:
+            conn, _ = server.accept()
+            print("-- connected")
+            with conn:
+                serve(conn)
+            print("-- disconnected")
+    except KeyboardInterrupt:
+        pass
+    finally:
+        os.unlink(path)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/ioctl.h>
+
+#include <libevdev/libevdev-uinput.h>
+
+#include "virtual_mk.h"
+
+#define MM_PER_INCH (25.4)
+#define NORMALIZED_DPI (1000.0)
+
+/* Device units to libinput's 1000dpi units, resolution is units per mm */
+static double touchpad_scale(int fd, unsigned int code)
+{
+    struct input_absinfo absinfo;
+
+    if (ioctl(fd, EVIOCGABS(code), &absinfo) < 0 || absinfo.resolution <= 0)
+        return 1.0;
+
+    return NORMALIZED_DPI / MM_PER_INCH / absinfo.resolution;
+}
+
+/* Rebuild slot state from the kernel, at startup and after SYN_DROPPED */
+static void touchpad_sync(struct virtual_mouse *mouse)
+{
+    static const unsigned int codes[] = { ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y };
+    struct touchpad *touchpad = &mouse->touchpad;
+    struct {
+        uint32_t code;
+        int32_t values[TOUCHPAD_MAX_SLOTS];
+    } mt;
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+    struct input_absinfo absinfo;
+
+    for (unsigned int i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+        /* The kernel fills only the slots the device has, the rest must read as lifted */
+        memset(mt.values, 0xff, sizeof(mt.values));
+        mt.code = codes[i];
+        ioctl(mouse->evdev_fd, EVIOCGMTSLOTS(sizeof(mt)), &mt);
+
+        for (int slot = 0; slot < touchpad->slot_count; slot++) {
+            struct touch_slot *s = &touchpad->slots[slot];
+
+            if (codes[i] == ABS_MT_TRACKING_ID)
+                s->tracking_id = mt.values[slot];
+            else if (codes[i] == ABS_MT_POSITION_X)
+                s->x = mt.values[slot];
+            else
+                s->y = mt.values[slot];
+            s->tracked = false;
+        }
+    }
+
+    touchpad->slot = 0;
+    if (ioctl(mouse->evdev_fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0)
+        touchpad->slot = absinfo.value;
+
+    touchpad->tool_fingers = 0;
+    ioctl(mouse->evdev_fd, EVIOCGKEY(sizeof(key_state)), key_state);
+    if (bit_is_set(key_state, BTN_TOOL_QUINTTAP))
+        touchpad->tool_fingers = 5;
+    else if (bit_is_set(key_state, BTN_TOOL_QUADTAP))
+        touchpad->tool_fingers = 4;
+    else if (bit_is_set(key_state, BTN_TOOL_TRIPLETAP))
+        touchpad->tool_fingers = 3;
+    else if (bit_is_set(key_state, BTN_TOOL_DOUBLETAP))
+        touchpad->tool_fingers = 2;
+    else if (bit_is_set(key_state, BTN_TOOL_FINGER))
+        touchpad->tool_fingers = 1;
+
+    /* Count changes suppress motion, so the first frame after a sync can't jump */
+    touchpad->last_fingers = -1;
+    touchpad->buttons_changed = 0;
+    memset(&touchpad->tap, 0, sizeof(touchpad->tap));
+}
+
+static void touchpad_tool(struct touchpad *touchpad, int fingers, int value)
+{
+    if (value)
+        touchpad->tool_fingers = fingers;
+    else if (touchpad->tool_fingers == fingers)
+        touchpad->tool_fingers = 0;
+}
+
+static bool touchpad_tap_moved(struct touchpad *touchpad, double move_mm)
+{
+    for (int slot = 0; slot < touchpad->slot_count; slot++) {
+        struct touch_slot *s = &touchpad->slots[slot];
+
+        if (s->tracking_id < 0 || !s->tracked)
+            continue;
+
+        if (hypot((s->x - s->start_x) * touchpad->scale_x, (s->y - s->start_y) * touchpad->scale_y) *
+            MM_PER_INCH / NORMALIZED_DPI > move_mm)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Tap-to-click without libinput's wait for a possible double tap: the
+ * button goes out with the lift that completes the tap, one finger for
+ * left, two for right, three for middle. A touch soon after a left tap
+ * that moves or stays down holds BTN_LEFT until it lifts; a quick second
+ * tap is simply a second click.
+ */
+static void touchpad_tap(struct virtual_mouse *mouse, int fingers, uint64_t time_us)
+{
+    static const uint32_t tap_buttons[] = { 0, BTN_LEFT, BTN_RIGHT, BTN_MIDDLE };
+    struct touchpad *touchpad = &mouse->touchpad;
+    struct tap_detector *tap = &touchpad->tap;
+    const struct tap_config *config = mouse->tap;
+    uint32_t button;
+
+    if (!config || !config->timeout_us)
+        return;
+
+    if (fingers) {
+        if (!tap->touching) {
+            tap->touching = true;
+            tap->down_us = time_us;
+            tap->fingers = 0;
+            tap->dead = false;
+            tap->drag_armed = tap->up_us && time_us - tap->up_us <= config->drag_timeout_us;
+        }
+
+        if (fingers > tap->fingers)
+            tap->fingers = fingers;
+        if (tap->fingers > 3 || touchpad->button_down || time_us - tap->down_us > config->timeout_us ||
+            touchpad_tap_moved(touchpad, config->move_mm))
+            tap->dead = true;
+
+        if (tap->drag_armed && tap->dead) {
+            if (tap->fingers == 1 && !touchpad->button_down) {
+                mouse_button(mouse, BTN_LEFT, 1, time_us);
+                tap->dragging = true;
+            }
+            tap->drag_armed = false;
+        }
+        return;
+    }
+
+    if (!tap->touching)
+        return;
+    tap->touching = false;
+    tap->up_us = 0;
+
+    if (tap->dragging) {
+        mouse_button(mouse, BTN_LEFT, 0, time_us);
+        tap->dragging = false;
+        return;
+    }
+
+    /* A finger held perfectly still sends no frames, so its timeout may only show at the lift */
+    if (tap->dead || time_us - tap->down_us > config->timeout_us)
+        return;
+
+    /* The latency from the lift is the tap delay, libinput's is its tap timeout */
+    button = tap_buttons[tap->fingers];
+    frame_mark(&mouse->frame, STAT_TAP, time_us);
+    mouse_button(mouse, button, 1, time_us);
+    mouse_button(mouse, button, 0, time_us);
+    if (button == BTN_LEFT)
+        tap->up_us = time_us;
+}
+
+static void touchpad_frame(struct virtual_mouse *mouse, uint64_t time_us)
+{
+    struct touchpad *touchpad = &mouse->touchpad;
+    struct touch_slot *active[2] = { NULL, NULL };
+    int fingers = 0;
+
+    for (int slot = 0; slot < touchpad->slot_count; slot++) {
+        if (touchpad->slots[slot].tracking_id < 0)
+            continue;
+        if (fingers < 2)
+            active[fingers] = &touchpad->slots[slot];
+        fingers++;
+    }
+
+    /* Devices with fewer slots than fingers report the rest through BTN_TOOL_* */
+    if (touchpad->tool_fingers > fingers)
+        fingers = touchpad->tool_fingers;
+
+    if (mouse->grabbed) {
+        if (fingers != touchpad->last_fingers) {
+            if (touchpad->last_fingers == 2) {
+                mouse_scroll(mouse, SCROLL_VERTICAL, 0, time_us);
+                mouse_scroll(mouse, SCROLL_HORIZONTAL, 0, time_us);
+            }
+        }
+        else if (fingers == 1 && active[0] && active[0]->tracked) {
+            mouse_motion(mouse,
+                (active[0]->x - active[0]->last_x) * touchpad->scale_x,
+                (active[0]->y - active[0]->last_y) * touchpad->scale_y, time_us);
+        }
+        else if (fingers == 2 && active[1] && active[0]->tracked && active[1]->tracked) {
+            double dx = (active[0]->x - active[0]->last_x + active[1]->x - active[1]->last_x) / 2.0;
+            double dy = (active[0]->y - active[0]->last_y + active[1]->y - active[1]->last_y) / 2.0;
+
+            if (dy)
+                mouse_scroll(mouse, SCROLL_VERTICAL, dy * touchpad->scale_y, time_us);
+            if (dx)
+                mouse_scroll(mouse, SCROLL_HORIZONTAL, dx * touchpad->scale_x, time_us);
+        }
+
+        touchpad_tap(mouse, fingers, time_us);
+
+        /* Clickpad: the finger count at press time picks the button */
+        if (touchpad->clickpad && touchpad->buttons_changed) {
+            if (touchpad->button_down) {
+                touchpad->click_button = fingers >= 3 ? BTN_MIDDLE : fingers == 2 ? BTN_RIGHT : BTN_LEFT;
+                mouse_button(mouse, touchpad->click_button, 1, time_us);
+            }
+            else if (touchpad->click_button) {
+                mouse_button(mouse, touchpad->click_button, 0, time_us);
+                touchpad->click_button = 0;
+            }
+        }
+        /* Physical buttons go through as they are */
+        else if (touchpad->buttons_changed) {
+            for (unsigned int bit = 0; bit < 3; bit++)
+                if (touchpad->buttons_changed & (1 << bit))
+                    mouse_button(mouse, BTN_LEFT + bit, !!(touchpad->buttons & (1 << bit)), time_us);
+        }
+    }
+
+    for (int slot = 0; slot < touchpad->slot_count; slot++) {
+        struct touch_slot *s = &touchpad->slots[slot];
+
+        if (!s->tracked && s->tracking_id >= 0) {
+            s->start_x = s->x;
+            s->start_y = s->y;
+        }
+        s->last_x = s->x;
+        s->last_y = s->y;
+        s->tracked = s->tracking_id >= 0;
+    }
+    touchpad->last_fingers = fingers;
+    touchpad->buttons_changed = 0;
+}
+
+static void touchpad_handle_event(struct virtual_mouse *mouse, struct input_event *event)
+{
+    struct touchpad *touchpad = &mouse->touchpad;
+    struct touch_slot *slot = NULL;
+
+    if (touchpad->slot >= 0 && touchpad->slot < touchpad->slot_count)
+        slot = &touchpad->slots[touchpad->slot];
+
+    switch (event->type)
+    {
+        case EV_ABS:
+            switch (event->code)
+            {
+                case ABS_MT_SLOT:
+                    touchpad->slot = event->value;
+                    break;
+
+                case ABS_MT_TRACKING_ID:
+                    if (slot) {
+                        slot->tracking_id = event->value;
+                        slot->tracked = false;
+                    }
+                    break;
+
+                case ABS_MT_POSITION_X:
+                    if (slot)
+                        slot->x = event->value;
+                    break;
+
+                case ABS_MT_POSITION_Y:
+                    if (slot)
+                        slot->y = event->value;
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+        case EV_KEY:
+            switch (event->code)
+            {
+                case BTN_LEFT:
+                case BTN_RIGHT:
+                case BTN_MIDDLE:
+                    if (event->value)
+                        touchpad->buttons |= 1 << (event->code - BTN_LEFT);
+                    else
+                        touchpad->buttons &= ~(1 << (event->code - BTN_LEFT));
+                    touchpad->buttons_changed |= 1 << (event->code - BTN_LEFT);
+                    touchpad->button_down = touchpad->buttons != 0;
+                    break;
+
+                case BTN_TOOL_FINGER:
+                    touchpad_tool(touchpad, 1, event->value);
+                    break;
+
+                case BTN_TOOL_DOUBLETAP:
+                    touchpad_tool(touchpad, 2, event->value);
+                    break;
+
+                case BTN_TOOL_TRIPLETAP:
+                    touchpad_tool(touchpad, 3, event->value);
+                    break;
+
+                case BTN_TOOL_QUADTAP:
+                    touchpad_tool(touchpad, 4, event->value);
+                    break;
+
+                case BTN_TOOL_QUINTTAP:
+                    touchpad_tool(touchpad, 5, event->value);
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+        case EV_SYN:
+            if (event->code == SYN_REPORT)
+                touchpad_frame(mouse, event_time_us(event));
+            break;
+
+        default:
+            break;
+    }
+}
+
+void touchpad_handle_events(struct virtual_mouse *mouse)
+{
+    struct input_event *events;
+    uint64_t events_read = mouse->reader.events_read;
+    int count, more;
+
+    do {
+        more = reader_fill(&mouse->reader, mouse->evdev_fd);
+        if (more < 0) {
+            fprintf(stderr, "Failed to read touchpad: %s\n", strerror(-more));
+            break;
+        }
+
+        while ((count = reader_next_frame(&mouse->reader, &events)) != 0) {
+            if (count == READER_RESYNC) {
+                touchpad_sync(mouse);
+                continue;
+            }
+
+            for (int i = 0; i < count; i++)
+                touchpad_handle_event(mouse, &events[i]);
+        }
+    } while (more);
+
+    if (!mouse->scheduler)
+        mouse_flush(mouse);
+    else if (mouse->motion.pending || mouse->scroll.pending)
+        scheduler_arm(mouse->scheduler);
+    frame_flush(&mouse->frame);
+    mouse->stats.wakeups++;
+    hist_add(&mouse->stats.batch, mouse->reader.events_read - events_read);
+}
+
+/* Keys a passthrough clone is put in line with, the rest of EV_KEY is never set on a touchpad */
+static const uint16_t passthrough_keys[] = {
+    BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_TOUCH, BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP,
+    BTN_TOOL_TRIPLETAP, BTN_TOOL_QUADTAP, BTN_TOOL_QUINTTAP,
+};
+
+/* Puts the clone in the touchpad's current state, after a resume or SYN_DROPPED */
+static void touchpad_passthrough_sync(struct virtual_mouse *mouse)
+{
+    struct touchpad *touchpad = &mouse->touchpad;
+    struct output_frame *frame = &mouse->frame;
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+
+    touchpad_sync(mouse);
+    ioctl(mouse->evdev_fd, EVIOCGKEY(sizeof(key_state)), key_state);
+
+    /* The clone has the source's slots only, a write past them would land on the last one */
+    for (int slot = 0; slot < touchpad->slot_count; slot++) {
+        struct touch_slot *s = &touchpad->slots[slot];
+
+        frame_write(frame, EV_ABS, ABS_MT_SLOT, slot);
+        frame_write(frame, EV_ABS, ABS_MT_TRACKING_ID, s->tracking_id);
+        if (s->tracking_id < 0)
+            continue;
+        frame_write(frame, EV_ABS, ABS_MT_POSITION_X, s->x);
+        frame_write(frame, EV_ABS, ABS_MT_POSITION_Y, s->y);
+    }
+    frame_write(frame, EV_ABS, ABS_MT_SLOT, touchpad->slot);
+
+    for (unsigned int i = 0; i < sizeof(passthrough_keys) / sizeof(passthrough_keys[0]); i++)
+        frame_write(frame, EV_KEY, passthrough_keys[i], bit_is_set(key_state, passthrough_keys[i]));
+    frame_sync(frame);
+    frame_flush(frame);
+}
+
+/* Lifts every finger and button on the clone the touchpad is leaving */
+void touchpad_passthrough_release(struct virtual_mouse *mouse)
+{
+    struct output_frame *frame = &mouse->frame;
+
+    for (int slot = 0; slot < mouse->touchpad.slot_count; slot++) {
+        frame_write(frame, EV_ABS, ABS_MT_SLOT, slot);
+        frame_write(frame, EV_ABS, ABS_MT_TRACKING_ID, -1);
+    }
+
+    for (unsigned int i = 0; i < sizeof(passthrough_keys) / sizeof(passthrough_keys[0]); i++)
+        frame_write(frame, EV_KEY, passthrough_keys[i], 0);
+    frame_sync(frame);
+    frame_flush(frame);
+}
+
+/*
+ * Passthrough: frames go to the clone exactly as read, nothing is parsed.
+ * Frames lying back to back in the reader buffer go out in one write,
+ * straight from the buffer; a refill may move it, so each run ends there.
+ */
+void touchpad_passthrough_events(struct virtual_mouse *mouse)
+{
+    struct input_event *events, *run = NULL;
+    uint64_t events_read = mouse->reader.events_read;
+    unsigned int run_count = 0;
+    int count, more;
+
+    do {
+        more = reader_fill(&mouse->reader, mouse->evdev_fd);
+        if (more < 0) {
+            fprintf(stderr, "Failed to read touchpad: %s\n", strerror(-more));
+            break;
+        }
+
+        while ((count = reader_next_frame(&mouse->reader, &events)) != 0) {
+            if (count == READER_RESYNC) {
+                if (mouse->grabbed) {
+                    frame_pass(&mouse->frame, run, run_count);
+                    touchpad_passthrough_sync(mouse);
+                }
+                run_count = 0;
+                continue;
+            }
+
+            if (!mouse->grabbed)
+                continue;
+
+            if (run_count && events != run + run_count) {
+                frame_pass(&mouse->frame, run, run_count);
+                run_count = 0;
+            }
+            if (!run_count)
+                run = events;
+            run_count += count;
+            frame_mark(&mouse->frame, STAT_MOTION, event_time_us(&events[count - 1]));
+        }
+
+        frame_pass(&mouse->frame, run, run_count);
+        run_count = 0;
+    } while (more);
+
+    mouse->stats.wakeups++;
+    hist_add(&mouse->stats.batch, mouse->reader.events_read - events_read);
+}
+
+/* One clone per output pair, so a target switch moves the touchpad with the rest */
+int touchpad_passthrough_create(struct virtual_mouse *mouse, struct virtual_output *outputs, int count)
+{
+    int ret;
+
+    for (int i = 0; i < count; i++) {
+        enum sink_type type = outputs[i].mouse_sink.type;
+
+        mouse->passthrough[i] = NULL;
+        if (type == SINK_UINPUT) {
+            ret = setup_virtual_touchpad(&mouse->passthrough[i], i, mouse->evdev_fd);
+            if (ret < 0) {
+                while (--i >= 0)
+                    libevdev_uinput_destroy(mouse->passthrough[i]);
+                return ret;
+            }
+        }
+
+        sink_init(&mouse->passthrough_sinks[i], type,
+            mouse->passthrough[i] ? libevdev_uinput_get_fd(mouse->passthrough[i]) : -1);
+    }
+    mouse->passthrough_count = count;
+
+    return 0;
+}
+
+/* Whatever queued up while suspended is stale, start again from the kernel's state */
+void touchpad_resume(struct virtual_mouse *mouse)
+{
+    reader_drain(&mouse->reader, mouse->evdev_fd);
+    if (mouse->backend == MOUSE_BACKEND_PASSTHROUGH)
+        touchpad_passthrough_sync(mouse);
+    else
+        touchpad_sync(mouse);
+}
+
+int touchpad_create(const char *path, struct virtual_mouse *mouse)
+{
+    unsigned long abs_bits[NLONGS(ABS_CNT)] = {0};
+    unsigned long props[NLONGS(INPUT_PROP_CNT)] = {0};
+    struct input_absinfo absinfo;
+    int clock = CLOCK_MONOTONIC;
+    int fd;
+
+    fd = handover_open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open touchpad %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    /* EVIOCGABS answers for any axis of a device with EV_ABS, only the bitmap says it has one */
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) < 0 ||
+        !bit_is_set(abs_bits, ABS_MT_POSITION_X)) {
+        fprintf(stderr, "%s is not a multitouch touchpad\n", path);
+        close(fd);
+        return -ENOTSUP;
+    }
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+
+    mouse->evdev_fd = fd;
+    mouse->fd = fd;
+    memset(&mouse->reader, 0, sizeof(mouse->reader));
+    memset(&mouse->touchpad, 0, sizeof(mouse->touchpad));
+    mouse->touchpad.scale_x = touchpad_scale(fd, ABS_MT_POSITION_X);
+    mouse->touchpad.scale_y = touchpad_scale(fd, ABS_MT_POSITION_Y);
+    ioctl(fd, EVIOCGPROP(sizeof(props)), props);
+    mouse->touchpad.clickpad = bit_is_set(props, INPUT_PROP_BUTTONPAD);
+
+    mouse->touchpad.slot_count = 1;
+    if (bit_is_set(abs_bits, ABS_MT_SLOT) && ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0 &&
+        absinfo.maximum >= 0)
+        mouse->touchpad.slot_count = absinfo.maximum < TOUCHPAD_MAX_SLOTS ? absinfo.maximum + 1 : TOUCHPAD_MAX_SLOTS;
+    touchpad_sync(mouse);
+
+    return 0;
+}
+
+void touchpad_close(struct virtual_mouse *mouse)
+{
+    close(mouse->evdev_fd);
+    for (int i = 0; i < mouse->passthrough_count; i++)
+        libevdev_uinput_destroy(mouse->passthrough[i]);
+    mouse->passthrough_count = 0;
+}
@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include <sys/epoll.h>
+
+#include "virtual_mk.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define URING_ENTRIES 256
+#define URING_SLOTS 64
+#define URING_GROUP 0
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE (64 * sizeof(struct input_event))
+#define URING_WRITE_SLOTS 64
+#define URING_BACKLOG 256
+
+enum uring_op {
+    URING_POLL,
+    URING_READ,
+    URING_WRITE,
+    URING_CANCEL,
+};
+
+#define URING_DATA(op, index) (((uint64_t)(index) << 2) | (op))
+
+/*
+ * Completions find their handler through a slot index, never a pointer:
+ * a removed handler's slot stays taken until its last completion, so a
+ * late CQE cannot reach freed memory.
+ */
+struct uring_slot {
+    struct input_handler *handler;
+    enum uring_op op;
+    bool busy;
+    bool removed;
+};
+
+/* A flushed frame, kept until its write completes */
+struct uring_write {
+    struct input_event events[FRAME_MAX_EVENTS];
+    int fd;
+    bool busy;
+};
+
+/* A frame waiting for a write slot, taken in flush order as slots free up */
+struct uring_backlog {
+    struct input_event events[FRAME_MAX_EVENTS];
+    unsigned int count;
+    int fd;
+};
+
+struct uring_loop {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *buffers;
+    struct uring_slot slots[URING_SLOTS];
+    struct uring_write writes[URING_WRITE_SLOTS];
+    unsigned int next_write;
+    struct uring_backlog *backlog;
+    unsigned int backlog_head;
+    unsigned int backlog_tail;
+    struct virtual_mk *v_mk;
+    uint64_t write_errors;
+    uint64_t backlogged;
+};
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_loop *uring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+
+    if (sqe)
+        return sqe;
+
+    /* Submission queue full, send what is queued and take the next */
+    io_uring_submit(&uring->ring);
+    uring->v_mk->loop_waits++;
+
+    return io_uring_get_sqe(&uring->ring);
+}
+
+static void uring_arm(struct uring_loop *uring, int index)
+{
+    struct uring_slot *slot = &uring->slots[index];
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+    if (!sqe) {
+        fprintf(stderr, "io_uring submission queue exhausted\n");
+        return;
+    }
+
+    if (slot->op == URING_READ)
+        io_uring_prep_read_multishot(sqe, slot->handler->fd, 0, 0, URING_GROUP);
+    else
+        io_uring_prep_poll_multishot(sqe, slot->handler->fd,
+            slot->handler->events ? slot->handler->events : POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_DATA(slot->op, index));
+}
+
+static void uring_recycle(struct uring_loop *uring, unsigned int bid)
+{
+    io_uring_buf_ring_add(uring->buf_ring, uring->buffers + bid * URING_BUFFER_SIZE, URING_BUFFER_SIZE,
+        bid, io_uring_buf_ring_mask(URING_BUFFERS), 0);
+    io_uring_buf_ring_advance(uring->buf_ring, 1);
+}
+
+int uring_create(struct virtual_mk *v_mk)
+{
+    struct uring_loop *uring;
+    struct io_uring_probe *probe;
+    int ret;
+
+    uring = calloc(1, sizeof(*uring));
+    if (!uring)
+        return -ENOMEM;
+    uring->v_mk = v_mk;
+
+    ret = io_uring_queue_init(URING_ENTRIES, &uring->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(-ret));
+        goto err_ring;
+    }
+
+    /* Multishot reads came in 6.7, before that every read would fail once armed */
+    probe = io_uring_get_probe_ring(&uring->ring);
+    if (!probe || !io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT)) {
+        fprintf(stderr, "io_uring has no multishot reads, needs Linux 6.7\n");
+        if (probe)
+            io_uring_free_probe(probe);
+        ret = -ENOTSUP;
+        goto err_buffers;
+    }
+    io_uring_free_probe(probe);
+
+    uring->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    uring->backlog = malloc(URING_BACKLOG * sizeof(*uring->backlog));
+    if (!uring->buffers || !uring->backlog) {
+        ret = -ENOMEM;
+        goto err_buf_ring;
+    }
+
+    uring->buf_ring = io_uring_setup_buf_ring(&uring->ring, URING_BUFFERS, URING_GROUP, 0, &ret);
+    if (!uring->buf_ring) {
+        fprintf(stderr, "Failed to set up io_uring provided buffers: %s\n", strerror(-ret));
+        goto err_buf_ring;
+    }
+
+    for (unsigned int bid = 0; bid < URING_BUFFERS; bid++)
+        io_uring_buf_ring_add(uring->buf_ring, uring->buffers + bid * URING_BUFFER_SIZE, URING_BUFFER_SIZE,
+            bid, io_uring_buf_ring_mask(URING_BUFFERS), bid);
+    io_uring_buf_ring_advance(uring->buf_ring, URING_BUFFERS);
+
+    v_mk->uring = uring;
+    return 0;
+
+err_buf_ring:
+    free(uring->backlog);
+    free(uring->buffers);
+err_buffers:
+    io_uring_queue_exit(&uring->ring);
+err_ring:
+    free(uring);
+    return ret;
+}
+
+/* Handlers with a reader get multishot reads into provided buffers, the rest multishot polls */
+int uring_add(struct uring_loop *uring, struct input_handler *handler)
+{
+    for (int index = 0; index < URING_SLOTS; index++) {
+        struct uring_slot *slot = &uring->slots[index];
+
+        if (slot->busy)
+            continue;
+
+        slot->handler = handler;
+        slot->op = handler->reader ? URING_READ : URING_POLL;
+        slot->busy = true;
+        slot->removed = false;
+        handler->slot = index;
+        if (handler->reader)
+            handler->reader->external = true;
+
+        uring_arm(uring, index);
+        return 0;
+    }
+
+    fprintf(stderr, "Too many io_uring handlers, at most %d\n", URING_SLOTS);
+    return -ENOSPC;
+}
+
+void uring_remove(struct uring_loop *uring, struct input_handler *handler)
+{
+    struct uring_slot *slot = &uring->slots[handler->slot];
+    struct io_uring_sqe *sqe;
+
+    slot->removed = true;
+    slot->handler = NULL;
+
+    sqe = uring_get_sqe(uring);
+    if (!sqe)
+        return;
+    io_uring_prep_cancel64(sqe, URING_DATA(slot->op, handler->slot), 0);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_CANCEL, 0));
+}
+
+static int uring_queue_write(struct uring_loop *uring, int fd, const struct input_event *events,
+    unsigned int count)
+{
+    struct uring_write *write = NULL;
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    for (unsigned int i = 0; i < URING_WRITE_SLOTS; i++) {
+        index = (uring->next_write + i) % URING_WRITE_SLOTS;
+        if (!uring->writes[index].busy) {
+            write = &uring->writes[index];
+            break;
+        }
+    }
+    if (!write)
+        return -EBUSY;
+
+    sqe = uring_get_sqe(uring);
+    if (!sqe)
+        return -EBUSY;
+
+    memcpy(write->events, events, count * sizeof(struct input_event));
+    write->fd = fd;
+    write->busy = true;
+    uring->next_write = index + 1;
+
+    /*
+     * Not linked: a link chains to whatever SQE comes next, which may be a
+     * re-arm or another sink's write. Writes to one fd are issued in SQ
+     * order, so frames to one device land in order anyway.
+     */
+    io_uring_prep_write(sqe, fd, write->events, count * sizeof(struct input_event), 0);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_WRITE, index));
+
+    return 0;
+}
+
+/* Moves backlogged frames onto the ring as their write slots free up */
+static void uring_flush_backlog(struct uring_loop *uring)
+{
+    while (uring->backlog_head != uring->backlog_tail) {
+        struct uring_backlog *frame = &uring->backlog[uring->backlog_head % URING_BACKLOG];
+
+        if (uring_queue_write(uring, frame->fd, frame->events, frame->count) < 0)
+            return;
+        uring->backlog_head++;
+    }
+}
+
+/*
+ * A frame that finds every write slot taken waits in the backlog, and
+ * so does every frame after it until the backlog is empty: a write() of
+ * its own could reach the device ahead of frames still on the ring.
+ */
+int uring_write(struct uring_loop *uring, struct output_sink *sink,
+    const struct input_event *events, unsigned int count)
+{
+    struct uring_backlog *frame;
+
+    if (count > FRAME_MAX_EVENTS)
+        return -E2BIG;
+
+    if (uring->backlog_head == uring->backlog_tail && !uring_queue_write(uring, sink->fd, events, count))
+        return 0;
+
+    if (uring->backlog_tail - uring->backlog_head == URING_BACKLOG) {
+        if (uring->write_errors++ == 0)
+            fprintf(stderr, "io_uring write backlog full, dropping frames\n");
+        return -ENOBUFS;
+    }
+
+    frame = &uring->backlog[uring->backlog_tail++ % URING_BACKLOG];
+    memcpy(frame->events, events, count * sizeof(struct input_event));
+    frame->count = count;
+    frame->fd = sink->fd;
+    uring->backlogged++;
+
+    return 0;
+}
+
+static void uring_complete_handler(struct uring_loop *uring, struct io_uring_cqe *cqe,
+    enum uring_op op, unsigned int index)
+{
+    struct uring_slot *slot = &uring->slots[index];
+    struct input_handler *handler = slot->handler;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    uint32_t events;
+
+    if (op == URING_READ && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (!slot->removed && cqe->res > 0)
+            reader_push(handler->reader, uring->buffers + bid * URING_BUFFER_SIZE, cqe->res);
+        uring_recycle(uring, bid);
+    }
+
+    if (slot->removed) {
+        if (!more)
+            slot->busy = false;
+        return;
+    }
+
+    if (op == URING_READ)
+        events = cqe->res > 0 ? EPOLLIN : cqe->res == 0 ? EPOLLHUP : cqe->res == -ENOBUFS ? 0 : EPOLLERR;
+    else
+        events = cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res;
+
+    if (events)
+        handler->dispatch(uring->v_mk, handler, events);
+
+    /* Multishot ends on errors and on running out of buffers */
+    if (!more && !slot->removed)
+        uring_arm(uring, index);
+    else if (!more)
+        slot->busy = false;
+}
+
+/*
+ * One io_uring_enter per burst: it submits the writes and re-arms queued
+ * while handling the last batch, then waits for the next completions.
+ */
+void uring_run(struct virtual_mk *v_mk)
+{
+    struct uring_loop *uring = v_mk->uring;
+    struct io_uring_cqe *cqe;
+    unsigned int head, count;
+    uint64_t data;
+    int ret;
+
+    while (1) {
+        ret = io_uring_submit_and_wait(&uring->ring, 1);
+        v_mk->loop_waits++;
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring wait failed: %s\n", strerror(-ret));
+            return;
+        }
+
+        count = 0;
+        io_uring_for_each_cqe(&uring->ring, head, cqe) {
+            data = io_uring_cqe_get_data64(cqe);
+            count++;
+
+            switch (data & 3)
+            {
+                case URING_POLL:
+                case URING_READ:
+                    uring_complete_handler(uring, cqe, data & 3, data >> 2);
+                    break;
+
+                case URING_WRITE:
+                    uring->writes[data >> 2].busy = false;
+                    TRACE(uinput_write, uring->writes[data >> 2].fd, cqe->res);
+                    if (cqe->res < 0 && uring->write_errors++ == 0)
+                        fprintf(stderr, "Failed to write frame: %s\n", strerror(-cqe->res));
+                    break;
+
+                default:
+                    break;
+            }
+        }
+        io_uring_cq_advance(&uring->ring, count);
+        uring_flush_backlog(uring);
+        TRACE(loop_wake, count);
+        devices_reap(v_mk);
+    }
+}
+
+void uring_destroy(struct uring_loop *uring)
+{
+    if (uring->write_errors || uring->backlogged)
+        printf("io_uring: %llu failed writes, %llu frames waited for a write slot\n",
+            (unsigned long long)uring->write_errors, (unsigned long long)uring->backlogged);
+    io_uring_free_buf_ring(&uring->ring, uring->buf_ring, URING_BUFFERS, URING_GROUP);
+    io_uring_queue_exit(&uring->ring);
+    free(uring->backlog);
+    free(uring->buffers);
+    free(uring);
+}
+
+#else
+
+int uring_create(struct virtual_mk *v_mk)
+{
+    fprintf(stderr, "Built without liburing\n");
+    return -ENOTSUP;
+}
+
+int uring_add(struct uring_loop *uring, struct input_handler *handler)
+{
+    return -ENOTSUP;
+}
+
+void uring_remove(struct uring_loop *uring, struct input_handler *handler)
+{
+}
+
+int uring_write(struct uring_loop *uring, struct output_sink *sink,
+    const struct input_event *events, unsigned int count)
+{
+    return -ENOTSUP;
+}
+
+void uring_run(struct virtual_mk *v_mk)
+{
+}
+
+void uring_destroy(struct uring_loop *uring)
+{
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <signal.h>
 #include <unistd.h>
 #include <argp.h>
@@ -14,30 +17,340 @@
 #include "config.h"
 #include "virtual_mk.h"
 
-static char doc[] = {"A utility to pass touchpad and keyboard as evdev to guest VMs."};
+static char doc[] = {"A utility to pass touchpad and keyboard as evdev to guest VMs."
+    "\v--threads does not combine with --record, --replay, --loop uring, --poll-rate, --repeat synth "
+    "or --backend passthrough; --handover not with --record, --replay, --loop uring or --backend "
+    "passthrough; --sink qmp not with --backend passthrough or --repeat synth."};
 
 static struct argp_option options[] = {
-    {"touchpad", 't', "String", 0, "Touchpad evdev"},
-    {"keyboard", 'k', "String", 0, "Keyboard evdev"},
+    {"touchpad", 't', "Pattern", 0, "Touchpad evdev path, glob or \"auto\", repeatable"},
+    {"keyboard", 'k', "Pattern", 0, "Keyboard evdev path, glob or \"auto\", repeatable"},
+    {"stats-socket", 's', "Path", 0, "Unix socket serving latency and rate statistics"},
+    {"record", 'r', "File", 0, "Record touchpad and keyboard evdev streams to a file"},
+    {"replay", 'p', "File", 0, "Replay a recording through the pipeline instead of live devices"},
+    {"replay-fast", 'f', 0, 0, "Replay as fast as possible and report throughput"},
+    {"sink", 'o', "uinput|memory|qmp", 0, "Output sink, memory only counts and hashes events, qmp sends to QEMU directly"},
+    {"qmp", 'q', "Path", 0, "QEMU QMP socket for the qmp sink, once per output pair"},
+    {"accel", 'a', "Curve", 0, "Pointer acceleration: linear:G, power:G:E or points:V=G,V=G,..."},
+    {"accel-file", 'A', "File", 0, "Read the acceleration curve from a file, re-read on SIGHUP"},
+    {"keymap", 'm', "File", 0, "Key remap table, one \"FROM TO\" or \"FROM drop\" per line"},
+    {"chord", 'C', "Action=Keys", 0, "Hotkey such as toggle=KEY_LEFTCTRL+KEY_RIGHTCTRL; actions toggle, grab, release, target1..target9"},
+    {"outputs", 'n', "Count", 0, "Virtual mouse/keyboard pairs to create, LCTRL+RCTRL+<n> switches between them"},
+    {"loop", 'l', "epoll|uring", 0, "Event loop backend, uring falls back to epoll when unavailable"},
+    {"threads", 'T', 0, 0, "Read each source device on its own thread, the event loop only writes"},
+    {"poll-rate", 'H', "Hz", 0, "Send touchpad motion and scroll at most this often, buttons and keys go out at once"},
+    {"realtime", 'R', 0, 0, "Run the event loop SCHED_FIFO with memory locked"},
+    {"rt-priority", 'P', "Priority", 0, "SCHED_FIFO priority for --realtime"},
+    {"cpu", 'c', "CPU", 0, "Pin the event loop to a CPU"},
+    {"backend", 'b', "libinput|native|passthrough", 0, "Touchpad backend, native reads multitouch frames without libinput, passthrough forwards them to a virtual touchpad"},
+    {"mouse-scale", 'S', "Factor", 0, "Motion factor for relative sources (mice), which are otherwise copied as read"},
+    {"tap", 'g', "off|Ms:Mm", 0, "Tap-to-click, longest tap in ms and furthest travel in mm (native backend); libinput only follows off"},
+    {"repeat", 'e', "forward|drop|synth|Ms:Hz", 0, "Host key repeats: passed on, dropped, or dropped and made here after a delay at a rate; synth needs input-linux repeat=on"},
+    {"handover", 'u', "Path", 0, "Take over the devices and grabs of a virtual_mk serving this socket, then serve it for the next one"},
+    {0},
 };
 
 struct arguments {
-    char *touchpad;
-    char *keyboard;
+    struct device_match matches[DEVICE_KIND_MAX];
+    char *stats_socket;
+    char *handover;
+    char *record;
+    char *replay;
+    bool replay_fast;
+    enum sink_type sink;
+    char *qmp[OUTPUT_POOL_MAX];
+    int qmp_count;
+    int outputs;
+    struct chord_set chords;
+    char *accel;
+    char *accel_file;
+    struct keymap keymap;
+    struct tap_config tap;
+    struct repeat_config repeat;
+    double mouse_scale;
+    enum mouse_backend backend;
+    enum loop_backend loop;
+    bool threads;
+    unsigned int poll_rate;
+    struct realtime realtime;
 };
 
+static void add_pattern(struct argp_state *state, struct device_match *match, char *arg)
+{
+    if (match->count == MAX_PATTERNS)
+        argp_error(state, "Too many patterns, at most %d", MAX_PATTERNS);
+    match->patterns[match->count++] = strdup(arg);
+}
+
+static void free_args(struct arguments *args)
+{
+    for (int kind = 0; kind < DEVICE_KIND_MAX; kind++)
+        for (int i = 0; i < args->matches[kind].count; i++)
+            free(args->matches[kind].patterns[i]);
+
+    for (int i = 0; i < args->qmp_count; i++)
+        free(args->qmp[i]);
+
+    free(args->accel);
+    free(args->accel_file);
+    accel_close();
+}
+
+/* A whole decimal number within [min, max], atoi takes "2x" for 2 and "x" for 0 */
+static int parse_int(const char *arg, int min, int max, int *value)
+{
+    char *end;
+    long number;
+
+    errno = 0;
+    number = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || number < min || number > max)
+        return -EINVAL;
+
+    *value = number;
+    return 0;
+}
+
+static error_t parse_end(struct argp_state *state)
+{
+    struct arguments *a = state->input;
+
+    /* The qmp sink needs one socket per pair, and the pair count follows them unless given */
+    if (!a->outputs)
+        a->outputs = a->sink == SINK_QMP && a->qmp_count ? a->qmp_count : OUTPUT_POOL_SIZE;
+
+    if (a->sink == SINK_QMP && a->qmp_count != a->outputs)
+        argp_error(state, "The qmp sink needs one --qmp socket per output pair");
+
+    /* Record and replay drive the devices from the main thread, io_uring reads them itself */
+    if (a->threads && (a->record || a->replay || a->loop == LOOP_URING))
+        argp_error(state, "--threads does not combine with --record, --replay or --loop uring");
+
+    /* The tick flushes touchpads from the main thread, which with reader threads it does not own */
+    if (a->poll_rate && a->threads)
+        argp_error(state, "--poll-rate does not combine with --threads");
+
+    /* QMP has no multitouch events, and a reader thread only knows the pair's own sinks */
+    if (a->backend == MOUSE_BACKEND_PASSTHROUGH && (a->sink == SINK_QMP || a->threads))
+        argp_error(state, "--backend passthrough does not combine with --sink qmp or --threads");
+
+    /* Made repeats are written from the main loop, which does not own a threaded keyboard */
+    if (a->repeat.mode == REPEAT_SYNTH && a->threads)
+        argp_error(state, "--repeat synth does not combine with --threads");
+
+    /* input-send-event has no repeat, qmp_format drops value 2 and the guest would see none */
+    if (a->repeat.mode == REPEAT_SYNTH && a->sink == SINK_QMP)
+        argp_error(state, "--repeat synth does not combine with --sink qmp");
+
+    /* Only the epoll loop stops reading while it hands over, threads and the ring keep going */
+    if (a->handover && (a->record || a->replay || a->threads || a->loop == LOOP_URING))
+        argp_error(state, "--handover does not combine with --record, --replay, --threads or --loop uring");
+
+    /* Passthrough clones are not handed over, the old process's exit would take them from the guest */
+    if (a->handover && a->backend == MOUSE_BACKEND_PASSTHROUGH)
+        argp_error(state, "--handover does not combine with --backend passthrough");
+
+    chord_defaults(&a->chords, a->outputs);
+
+    if (a->accel_file) {
+        if (accel_load(a->accel_file) < 0)
+            argp_error(state, "Invalid acceleration file: %s", a->accel_file);
+    }
+    else if (accel_set(a->accel ? a->accel : ACCEL_CURVE) < 0) {
+        argp_error(state, "Invalid acceleration curve: %s", a->accel ? a->accel : ACCEL_CURVE);
+    }
+
+    return 0;
+}
+
 static error_t parse_options(int key, char *arg, struct argp_state *state)
 {
     struct arguments *a = state->input;
     switch (key)
     {
         case 't':
-            a->touchpad = strdup(arg);
+            add_pattern(state, &a->matches[DEVICE_TOUCHPAD], arg);
             break;
         
         case 'k':
-            a->keyboard = strdup(arg);
-            break;    
+            add_pattern(state, &a->matches[DEVICE_KEYBOARD], arg);
+            break;
+
+        case 's':
+            a->stats_socket = strdup(arg);
+            break;
+
+        case 'r':
+            a->record = strdup(arg);
+            break;
+
+        case 'p':
+            a->replay = strdup(arg);
+            break;
+
+        case 'f':
+            a->replay_fast = true;
+            break;
+
+        case 'o':
+            if (!strcmp(arg, "memory"))
+                a->sink = SINK_MEMORY;
+            else if (!strcmp(arg, "uinput"))
+                a->sink = SINK_UINPUT;
+            else if (!strcmp(arg, "qmp"))
+                a->sink = SINK_QMP;
+            else
+                argp_error(state, "Unknown sink: %s", arg);
+            break;
+
+        case 'q':
+            if (a->qmp_count == OUTPUT_POOL_MAX)
+                argp_error(state, "Too many QMP sockets, at most %d", OUTPUT_POOL_MAX);
+            a->qmp[a->qmp_count++] = strdup(arg);
+            break;
+
+        case 'a':
+            a->accel = strdup(arg);
+            break;
+
+        case 'A':
+            a->accel_file = strdup(arg);
+            break;
+
+        case 'm':
+            if (keymap_load(&a->keymap, arg) < 0)
+                argp_error(state, "Invalid keymap: %s", arg);
+            break;
+
+        case 'C':
+            if (chord_compile(&a->chords, arg) < 0)
+                argp_error(state, "Invalid chord: %s", arg);
+            break;
+
+        case 'n':
+            if (parse_int(arg, 1, OUTPUT_POOL_MAX, &a->outputs) < 0)
+                argp_error(state, "Output count must be between 1 and %d", OUTPUT_POOL_MAX);
+            break;
+
+        case 'l':
+            if (!strcmp(arg, "uring"))
+                a->loop = LOOP_URING;
+            else if (!strcmp(arg, "epoll"))
+                a->loop = LOOP_EPOLL;
+            else
+                argp_error(state, "Unknown loop: %s", arg);
+            break;
+
+        case 'T':
+            a->threads = true;
+            break;
+
+        case 'H': {
+            int poll_rate;
+
+            if (parse_int(arg, 1, 100000, &poll_rate) < 0)
+                argp_error(state, "Poll rate must be between 1 and 100000 Hz");
+            a->poll_rate = poll_rate;
+            break;
+        }
+
+        case 'u':
+            a->handover = strdup(arg);
+            break;
+
+        case 'S': {
+            char *end;
+
+            a->mouse_scale = strtod(arg, &end);
+            if (end == arg || *end || !(a->mouse_scale > 0 && a->mouse_scale <= 100))
+                argp_error(state, "Mouse scale must be above 0 and at most 100");
+            break;
+        }
+
+        case 'e': {
+            const char *rate = strchr(arg, ':');
+            char delay[16];
+            int delay_ms, rate_hz;
+
+            if (!strcmp(arg, "forward")) {
+                a->repeat.mode = REPEAT_FORWARD;
+                break;
+            }
+            if (!strcmp(arg, "drop")) {
+                a->repeat.mode = REPEAT_DROP;
+                break;
+            }
+            if (!strcmp(arg, "synth")) {
+                a->repeat.mode = REPEAT_SYNTH;
+                break;
+            }
+
+            if (!rate || rate - arg >= (long)sizeof(delay))
+                argp_error(state, "Invalid repeat policy: %s", arg);
+            snprintf(delay, rate - arg + 1, "%s", arg);
+            if (parse_int(delay, 1, 10000, &delay_ms) < 0 || parse_int(rate + 1, 1, 1000, &rate_hz) < 0)
+                argp_error(state, "Repeat delay must be 1 to 10000 ms and rate 1 to 1000 Hz: %s", arg);
+            a->repeat.mode = REPEAT_SYNTH;
+            a->repeat.delay_ms = delay_ms;
+            a->repeat.rate = rate_hz;
+            break;
+        }
+
+        case 'R':
+            a->realtime.enabled = true;
+            break;
+
+        case 'P':
+            if (parse_int(arg, sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO),
+                &a->realtime.priority) < 0)
+                argp_error(state, "SCHED_FIFO priority must be between %d and %d",
+                    sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+            break;
+
+        case 'c':
+            if (parse_int(arg, 0, sysconf(_SC_NPROCESSORS_CONF) - 1, &a->realtime.cpu) < 0)
+                argp_error(state, "Invalid CPU: %s", arg);
+            break;
+
+        case 'g': {
+            double timeout_ms, move_mm = 0;
+            char *end;
+
+            if (!strcmp(arg, "off")) {
+                a->tap.timeout_us = 0;
+                break;
+            }
+
+            /* MS:MM, both may be fractional; parsing has to end exactly at the string's end */
+            timeout_ms = strtod(arg, &end);
+            if (end != arg && *end == ':') {
+                const char *mm = end + 1;
+
+                move_mm = strtod(mm, &end);
+                if (end == mm)
+                    move_mm = 0;
+            }
+            if (*end || !(timeout_ms > 0 && timeout_ms <= 10000) || !(move_mm > 0 && move_mm <= 100))
+                argp_error(state, "Invalid tap thresholds: %s", arg);
+            a->tap.timeout_us = timeout_ms * 1000;
+            a->tap.move_mm = move_mm;
+            break;
+        }
+
+        case 'b':
+            if (!strcmp(arg, "native"))
+                a->backend = MOUSE_BACKEND_NATIVE;
+            else if (!strcmp(arg, "libinput"))
+                a->backend = MOUSE_BACKEND_LIBINPUT;
+            else if (!strcmp(arg, "passthrough"))
+                a->backend = MOUSE_BACKEND_PASSTHROUGH;
+            else
+                argp_error(state, "Unknown backend: %s", arg);
+            break;
+
+        case ARGP_KEY_END:
+            return parse_end(state);
+
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -46,63 +359,294 @@ static error_t parse_options(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = { options, parse_options, NULL, doc };
 
-static void signal_handler(struct signalfd_siginfo *signal, struct virtual_mk *v_mk) {
+static int outputs_create(struct virtual_output *outputs, struct arguments *args,
+    struct handover *handover)
+{
+    int ret;
+
+    for (int i = 0; i < args->outputs; i++) {
+        /* A handed over pair is the device the guest already has open */
+        if (i < handover->output_count) {
+            output_inherit(&outputs[i], handover->mouse_fds[i], handover->keyboard_fds[i],
+                handover->mouse_devnodes[i], handover->keyboard_devnodes[i]);
+            handover->mouse_fds[i] = handover->keyboard_fds[i] = -1;
+            continue;
+        }
+
+        ret = output_create(&outputs[i], args->sink, i, args->qmp[i], &args->keymap);
+        if (ret < 0) {
+            while (--i >= 0)
+                output_destroy(&outputs[i], i);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void outputs_destroy(struct virtual_output *outputs, int count)
+{
+    for (int i = 0; i < count; i++)
+        output_destroy(&outputs[i], i);
+}
+
+static void dispatch_signal(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    struct signalfd_siginfo signal;
+
+    if (read(v_mk->signal_fd, &signal, sizeof(signal)) != sizeof(signal))
+        return;
+
+    /* The new curve replaces the table in place, the devices stay as they are */
+    if (signal.ssi_signo == SIGHUP) {
+        if (v_mk->accel_file && !accel_load(v_mk->accel_file))
+            printf("Acceleration curve: %s\n", accel_curve());
+        return;
+    }
+
     printf("Interrupted!\n");
-    mouse_close(v_mk->mouse);
-    keyboard_close(v_mk->keyboard);
+    stats_loop_report(stdout, v_mk);
+    devices_close(v_mk);
+    hotplug_close(v_mk);
+    outputs_destroy(v_mk->outputs, v_mk->output_count);
+    if (v_mk->recorder)
+        recorder_close(v_mk->recorder);
+    stats_close(v_mk);
+    handover_close(v_mk);
+    threads_close(v_mk);
+    scheduler_close(v_mk);
+    if (v_mk->uring)
+        uring_destroy(v_mk->uring);
     close(v_mk->epoll_fd);
     close(v_mk->signal_fd);
+    accel_close();
     exit(EXIT_SUCCESS);
 }
 
+static void dispatch_stats(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    stats_serve(v_mk);
+}
+
+static void dispatch_recorder(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events)
+{
+    recorder_handle_events(v_mk->recorder);
+}
+
+static uint64_t cpu_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Feeds a recording through uinput clones of the recorded devices, so the
+ * frames take the same libinput/raw read path as live input. The clones
+ * are held exclusively and never reach the host.
+ */
+static int run_replay(struct arguments *args, struct virtual_mk *v_mk)
+{
+    struct replay replay;
+    struct input_device *devices[RECORD_SOURCE_MAX];
+    struct input_handler *handler;
+    enum record_source source;
+    uint64_t start_us, start_cpu, elapsed_us, cpu_ns, events = 0, frames = 0;
+    int count, ret;
+
+    ret = replay_open(&replay, args->replay);
+    if (ret < 0)
+        return ret;
+
+    v_mk->exclusive = true;
+
+    ret = device_add(v_mk, DEVICE_TOUCHPAD, replay_devnode(&replay, RECORD_TOUCHPAD), &devices[RECORD_TOUCHPAD]);
+    if (ret < 0)
+        goto error_devices;
+
+    ret = device_add(v_mk, DEVICE_KEYBOARD, replay_devnode(&replay, RECORD_KEYBOARD), &devices[RECORD_KEYBOARD]);
+    if (ret < 0)
+        goto error_devices;
+
+    if (v_mk->realtime->enabled || v_mk->realtime->cpu >= 0)
+        realtime_setup(v_mk->realtime);
+
+    start_us = monotonic_us();
+    start_cpu = cpu_time_ns();
+
+    while ((count = replay_next(&replay, &source)) > 0) {
+        if (!args->replay_fast) {
+            uint64_t deadline = start_us + replay.time_us;
+            struct timespec ts = {
+                .tv_sec = deadline / 1000000,
+                .tv_nsec = (deadline % 1000000) * 1000,
+            };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        ret = replay_inject(&replay, source, count);
+        if (ret < 0)
+            break;
+
+        handler = &devices[source]->handler;
+        handler->dispatch(v_mk, handler, EPOLLIN);
+
+        events += count;
+        frames++;
+    }
+
+    elapsed_us = monotonic_us() - start_us;
+    cpu_ns = cpu_time_ns() - start_cpu;
+    if (ret < 0)
+        goto error_devices;
+
+    printf("Replayed %llu events in %llu frames over %.3fs: %.0f events/s, %.0f ns CPU per event\n",
+        (unsigned long long)events, (unsigned long long)frames, elapsed_us / 1e6,
+        elapsed_us ? events * 1e6 / elapsed_us : 0, events ? (double)cpu_ns / events : 0);
+
+error_devices:
+    devices_close(v_mk);
+    replay_close(&replay);
+    return ret;
+}
+
 int main(int argc, char *argv[]) {
-    struct epoll_event epoll_event, events[10] = {0};
-    struct signalfd_siginfo signal = {0};
+    struct epoll_event events[MAX_EPOLL_EVENTS] = {0};
+    struct input_handler *handler;
     sigset_t mask;
-    int epoll_fd, signal_fd, libinput_fd, count = 0, ret = 0;
+    int epoll_fd, signal_fd, count = 0, ret = 0;
 
     struct arguments args = {
-        .keyboard = NULL,
-        .touchpad = NULL,
+        .stats_socket = NULL,
+        .record = NULL,
+        .replay = NULL,
+        .replay_fast = false,
+        .sink = SINK_UINPUT,
+        .outputs = 0,
+        .poll_rate = SCHEDULER_RATE,
+        .backend = MOUSE_BACKEND_LIBINPUT,
+        .tap = {
+            .timeout_us = TAP_TIMEOUT_US,
+            .drag_timeout_us = TAP_DRAG_TIMEOUT_US,
+            .move_mm = TAP_MOVE_MM,
+        },
+        .mouse_scale = MOUSE_SCALE,
+        .repeat = {
+            .mode = REPEAT_FORWARD,
+            .delay_ms = KEY_REPEAT_DELAY_MS,
+            .rate = KEY_REPEAT_RATE,
+        },
+        .realtime = {
+            .enabled = false,
+            .priority = REALTIME_PRIORITY,
+            .cpu = -1,
+        },
     };
 
-    struct virtual_mouse mouse = {
-        .libinput_context = NULL,
-        .output_device = NULL,
-        .libinput_fd = -1,
-        .evdev_fd = -1,
-    };
+    struct recorder recorder;
+    struct virtual_output outputs[OUTPUT_POOL_MAX];
+    struct handover handover = { .fd = -1 };
 
-    struct virtual_keyboard keyboard = {
-        .evdev = NULL,
-        .output_device = NULL,
-        .fd = -1,
-        .grabbed = 0,
-    };
+    keymap_init(&args.keymap);
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+
+    if (args.handover) {
+        ret = handover_receive(args.handover, &handover);
+        if (ret < 0) {
+            free_args(&args);
+            free(args.handover);
+            return ret;
+        }
+
+        /* Dropping pairs the guests may still have open takes a plain restart */
+        if (handover.output_count > (args.sink == SINK_UINPUT ? args.outputs : 0)) {
+            fprintf(stderr, "Running instance has %d uinput pairs, restart without --handover to change that\n",
+                handover.output_count);
+            free_args(&args);
+            free(args.handover);
+            return -EINVAL;
+        }
+    }
 
-    argp_parse(&argp, argc, argv, 0, 0, &args);    
-    if (!args.keyboard) {
+    ret = outputs_create(outputs, &args, &handover);
+    if (ret < 0) {
+        free_args(&args);
+        free(args.handover);
+        return ret;
+    }
+
+    if (args.replay) {
+        /* A recording is taken while grabbed and rarely holds the chord, start out forwarding */
+        struct virtual_mk v_mk = {
+            .outputs = outputs,
+            .output = &outputs[0],
+            .output_count = args.outputs,
+            .chords = &args.chords,
+            .keymap = &args.keymap,
+            .tap = &args.tap,
+            .repeat = args.repeat,
+            .mouse_scale = args.mouse_scale,
+            .backend = args.backend,
+            .realtime = &args.realtime,
+            .grabbed = true,
+            .epoll_fd = -1,
+            .stats_fd = -1,
+            .handover_fd = -1,
+            .devices_lock = PTHREAD_MUTEX_INITIALIZER,
+        };
+
+        ret = run_replay(&args, &v_mk);
+        outputs_destroy(outputs, args.outputs);
+        free_args(&args);
+        free(args.replay);
+        free(args.stats_socket);
+        free(args.handover);
+        return ret;
+    }
+
+    if (!args.matches[DEVICE_KEYBOARD].count) {
         fprintf(stderr, "Empty path for keyboard\n");
-        return -EINVAL;
+        ret = -EINVAL;
+        goto error_args;
     }
-    if (!args.touchpad) {
+    if (!args.matches[DEVICE_TOUCHPAD].count) {
         fprintf(stderr, "Empty path for touchpad\n");
-        return -EINVAL;
+        ret = -EINVAL;
+        goto error_args;
     }
 
     struct virtual_mk v_mk = {
-        .mouse = &mouse,
-        .keyboard = &keyboard,
+        .outputs = outputs,
+        .output = &outputs[handover.output < args.outputs ? handover.output : 0],
+        .output_count = args.outputs,
+        .chords = &args.chords,
+        .keymap = &args.keymap,
+        .tap = &args.tap,
+        .repeat = args.repeat,
+        .mouse_scale = args.mouse_scale,
+        .grabbed = handover.grabbed,
+        .matches = args.matches,
+        .backend = args.backend,
+        .stats_fd = -1,
+        .stats_path = args.stats_socket,
+        .handover_fd = -1,
+        .accel_file = args.accel_file,
+        .realtime = &args.realtime,
+        .start_us = monotonic_us(),
+        .devices_lock = PTHREAD_MUTEX_INITIALIZER,
     };
 
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
     sigprocmask(SIG_BLOCK, &mask, NULL);
 
     signal_fd = signalfd(-1, &mask, 0);
     if (signal_fd < 0) {
         fprintf(stderr, "Failed to open signal file descriptor: %s\n", strerror(errno));
-        return -errno;
+        ret = -errno;
+        goto error_args;
     }
     v_mk.signal_fd = signal_fd;
 
@@ -114,71 +658,142 @@ int main(int argc, char *argv[]) {
     }
     v_mk.epoll_fd = epoll_fd;
 
-    ret = mouse_create(args.touchpad, &mouse);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to create mouse: %s\n", strerror(errno));
-        ret = -errno;
-        goto error_mouse;
+    if (args.loop == LOOP_URING && uring_create(&v_mk) < 0)
+        fprintf(stderr, "Falling back to epoll\n");
+
+    if (args.threads) {
+        ret = threads_init(&v_mk);
+        if (ret < 0)
+            goto error_stats;
     }
 
-    ret = keyboard_create(args.keyboard, &keyboard);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to create keyboard: %s\n", strerror(errno));
-        ret = -errno;
-        goto error_keyboard;
+    /* Before any device is added, touchpads pick up the pacing as they come */
+    if (args.poll_rate) {
+        ret = scheduler_init(&v_mk, args.poll_rate);
+        if (ret < 0)
+            goto error_stats;
+    }
+
+    /* Output frames are queued on the ring and go out with the next submit */
+    for (int i = 0; v_mk.uring && i < v_mk.output_count; i++) {
+        if (outputs[i].mouse_sink.type != SINK_UINPUT)
+            continue;
+        outputs[i].mouse_sink.uring = v_mk.uring;
+        outputs[i].keyboard_sink.uring = v_mk.uring;
+    }
+
+    /* Replies, stalled sends and reconnects are handled on the loop from now on */
+    for (int i = 0; i < v_mk.output_count; i++) {
+        if (outputs[i].keyboard_sink.type != SINK_QMP)
+            continue;
+        ret = qmp_watch(&v_mk, &outputs[i].qmp);
+        if (ret < 0)
+            goto error_stats;
+    }
+
+    v_mk.signal_handler.fd = signal_fd;
+    v_mk.signal_handler.dispatch = dispatch_signal;
+    handler_add(&v_mk, &v_mk.signal_handler);
+
+    if (args.stats_socket) {
+        ret = stats_listen(args.stats_socket);
+        if (ret < 0)
+            goto error_stats;
+        v_mk.stats_fd = ret;
+
+        v_mk.stats_handler.fd = v_mk.stats_fd;
+        v_mk.stats_handler.dispatch = dispatch_stats;
+        handler_add(&v_mk, &v_mk.stats_handler);
     }
 
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = signal_fd;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &epoll_event);
+    /* Before any device is added, reader threads inherit the policy and the CPU */
+    if (args.realtime.enabled || args.realtime.cpu >= 0)
+        realtime_setup(&args.realtime);
+
+    if (args.record) {
+        /* A recording describes exactly one touchpad and one keyboard, taken literally */
+        const char *touchpad = args.matches[DEVICE_TOUCHPAD].patterns[0];
+        const char *keyboard = args.matches[DEVICE_KEYBOARD].patterns[0];
 
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = mouse.libinput_fd;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mouse.libinput_fd, &epoll_event);
+        ret = recorder_open(&recorder, args.record, touchpad, keyboard);
+        if (ret < 0)
+            goto error_recorder;
+        v_mk.recorder = &recorder;
 
-    epoll_event.events = EPOLLIN;
-    epoll_event.data.fd = keyboard.fd;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, keyboard.fd, &epoll_event);
+        v_mk.recorder_handler.fd = recorder.tap_fd;
+        v_mk.recorder_handler.dispatch = dispatch_recorder;
+        handler_add(&v_mk, &v_mk.recorder_handler);
 
-    free(args.touchpad);
-    free(args.keyboard);
+        ret = device_add(&v_mk, DEVICE_TOUCHPAD, recorder_touchpad_devnode(&recorder), NULL);
+        if (ret < 0)
+            goto error_devices;
+
+        ret = device_add(&v_mk, DEVICE_KEYBOARD, keyboard, NULL);
+        if (ret < 0)
+            goto error_devices;
+    }
+    else {
+        ret = hotplug_init(&v_mk);
+        if (ret < 0)
+            goto error_devices;
+    }
+
+    /* The error paths below free it again */
+    free(args.record);
+    args.record = NULL;
+
+    if (args.handover) {
+        /* Every device is back, the old process can go. Without its ack it may still be running */
+        ret = handover_finish(&handover, &v_mk);
+        if (ret < 0)
+            goto error_devices;
+
+        ret = handover_listen(&v_mk, args.handover);
+        if (ret < 0)
+            goto error_devices;
+    }
+
+    /* Only returns when the ring fails */
+    if (v_mk.uring) {
+        uring_run(&v_mk);
+        ret = -EIO;
+        goto error_devices;
+    }
 
     while(1) {
-        count = epoll_wait(epoll_fd, events, 10, -1);
+        count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        v_mk.loop_waits++;
+        TRACE(loop_wake, count);
         // printf("No of epoll events: %d\n", count);
         for (int n = 0; n < count; n++) {
-            if (events[n].events & EPOLLIN) {
-                // printf("events[%d]: %d\n", n,  events[n].data.fd);
-                if (events[n].data.fd == signal_fd) {
-                    signal_handler(&signal, &v_mk);
-                }
-                else if (events[n].data.fd == mouse.libinput_fd) {
-                    libinput_dispatch(mouse.libinput_context);
-                    mouse_handle_events(&mouse);
-                }
-                else if (events[n].data.fd == keyboard.fd) {
-                    keyboard_handle_events(&keyboard);
-
-                    if (keyboard.grabbed && !mouse.grabbed) {
-                        // printf("Mouse grab\n");
-                        mouse_grab_global(&mouse, true);
-                    }
-                    else if (!keyboard.grabbed && mouse.grabbed) {
-                        // printf("Mouse ungrab\n");
-                        mouse_grab_global(&mouse, false);
-                    }
-                }
-            }
+            handler = events[n].data.ptr;
+            // printf("events[%d]: %d\n", n, handler->fd);
+            handler->dispatch(&v_mk, handler, events[n].events);
         }
+        devices_reap(&v_mk);
     }
 
-error_keyboard:
-    mouse_close(&mouse);
-error_mouse:
+error_devices:
+    devices_close(&v_mk);
+    hotplug_close(&v_mk);
+    if (v_mk.recorder)
+        recorder_close(&recorder);
+error_recorder:
+    stats_close(&v_mk);
+    handover_close(&v_mk);
+error_stats:
+    threads_close(&v_mk);
+    scheduler_close(&v_mk);
+    if (v_mk.uring)
+        uring_destroy(v_mk.uring);
     close(epoll_fd);
 error_epoll_init:
     close(signal_fd);
-    free(args.touchpad);
-    free(args.keyboard);
+error_args:
+    outputs_destroy(outputs, args.outputs);
+    free_args(&args);
+    free(args.stats_socket);
+    free(args.handover);
+    free(args.record);
     return ret;
-}
\ No newline at end of file
+}
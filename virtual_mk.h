@@ -1,6 +1,64 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <linux/input.h>
+
+/*
+ * USDT probes under the virtual_mk provider, read by the scripts in
+ * trace/. Each is a single nop until a tracer attaches; without sys/sdt.h
+ * they compile out and their arguments are never evaluated.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(virtual_mk, name, __VA_ARGS__)
+#else
+#define TRACE(name, ...) do { } while (0)
+#endif
+
+#define FRAME_MAX_EVENTS 64
+#define READER_MAX_EVENTS 128
+#define READER_RESYNC (-1)
+#define FRAME_MAX_SAMPLES 32
+
+#define TOUCHPAD_MAX_SLOTS 10
+#define MAX_EPOLL_EVENTS 32
+#define MAX_PATTERNS 8
+#define RING_SIZE 64
+#define KEYMAP_DEFAULT_LAST 248
+#define ACCEL_TABLE_SIZE 1024
+#define ACCEL_MAX_VELOCITY 64
+#define ACCEL_MAX_POINTS 16
+#define ACCEL_CURVE_SIZE 256
+#define CHORD_MAX 16
+#define QMP_BUFFER_SIZE (64 * 1024)
+#define QMP_COMMAND_SIZE (16 * 1024)
+#define OUTPUT_POOL_MAX 9
+#define DEVICE_NAME_SIZE 64
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define RECORD_MAGIC "VMKR"
+#define RECORD_VERSION 1
+#define RECORD_NAME_SIZE 80
+
+#define HANDOVER_MAGIC "VMKH"
+#define HANDOVER_VERSION 1
+#define HANDOVER_DEVICES_MAX 32
+
+/* Log-linear histogram: 8 sub-buckets per power of two, up to ~67s in us */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 24)
+
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define NLONGS(x) (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 // typedef struct pointer {
 //     int type;
@@ -23,46 +81,788 @@
 //     gesture gesture;
 // };
 
+enum stat_class {
+    STAT_MOTION,
+    STAT_BUTTON,
+    STAT_SCROLL,
+    STAT_KEY,
+    STAT_GRAB,
+    STAT_TAP,
+    STAT_CLASS_MAX,
+};
+
+struct latency_hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+struct device_stats {
+    const char *name;
+    struct latency_hist latency[STAT_CLASS_MAX];
+    uint64_t events[STAT_CLASS_MAX];
+    uint64_t last_events[STAT_CLASS_MAX];
+    struct latency_hist batch;
+    struct latency_hist merged;
+    uint64_t wakeups;
+    uint64_t last_wakeups;
+};
+
+enum sink_type {
+    SINK_UINPUT,
+    SINK_MEMORY,
+    SINK_QMP,
+    SINK_RING,
+};
+
+struct virtual_mk;
+
+/*
+ * Every fd in the event loop carries one of these, in epoll's data.ptr
+ * or an io_uring slot, so a wakeup goes straight to its handler. Handlers
+ * with a reader can have their reads done by the loop.
+ */
+struct input_handler {
+    int fd;
+    void (*dispatch)(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events);
+    struct evdev_reader *reader;
+    /* What the loop waits for, EPOLLIN when left 0 */
+    uint32_t events;
+    int slot;
+};
+
+/*
+ * A QEMU monitor socket taking input-send-event commands. Commands are
+ * queued in out and sent without waiting for replies. On the event loop
+ * replies are read as they come, a stalled send waits for EPOLLOUT and a
+ * lost connection is retried every QMP_RECONNECT_INTERVAL from a timer;
+ * off it, all of that happens on the next write. down holds what the
+ * guest was last sent as pressed, it is released after a reconnect;
+ * releasing is set while some of those ups are still waiting for room.
+ */
+struct qmp_connection {
+    const char *path;
+    int fd;
+    struct virtual_mk *v_mk;
+    struct input_handler handler;
+    struct input_handler timer;
+    char out[QMP_BUFFER_SIZE];
+    size_t out_len;
+    unsigned long down[NLONGS(KEY_CNT)];
+    bool releasing;
+    unsigned int error_match;
+    uint64_t last_attempt_us;
+    uint64_t connects;
+    uint64_t commands;
+    uint64_t replies;
+    uint64_t errors;
+    uint64_t dropped;
+};
+
+/*
+ * Where flushed frames end up. The uinput sink writes to the virtual
+ * device, the memory sink only counts and hashes the stream so replays
+ * can be benchmarked and compared without touching /dev/uinput. The QMP
+ * sink hands frames straight to QEMU.
+ */
+struct output_sink {
+    enum sink_type type;
+    int (*write)(struct output_sink *sink, const struct input_event *events, unsigned int count);
+    int fd;
+    struct qmp_connection *qmp;
+    struct uring_loop *uring;
+    uint64_t frames;
+    uint64_t syscalls;
+    uint64_t events;
+    uint64_t hash;
+};
+
+/*
+ * Kernel timestamp of a source event, kept until the frame carrying it
+ * has been written so the histogram sees the full forwarding latency.
+ */
+struct frame_sample {
+    uint64_t time_us;
+    enum stat_class class;
+};
+
+/*
+ * Events destined for one uinput device are collected here and handed to
+ * the kernel with a single write(), instead of one write per input_event.
+ */
+struct output_frame {
+    struct input_event events[FRAME_MAX_EVENTS];
+    unsigned int count;
+    struct output_sink *sink;
+    uint64_t events_written;
+    uint64_t syscalls;
+    uint64_t syscalls_saved;
+    struct device_stats *stats;
+    struct frame_sample samples[FRAME_MAX_SAMPLES];
+    unsigned int sample_count;
+};
+
+/*
+ * Raw input_events read straight from an evdev fd. Whole SYN_REPORT frames
+ * are handed out; a trailing partial frame stays until the next read.
+ */
+struct evdev_reader {
+    struct input_event events[READER_MAX_EVENTS];
+    unsigned int head;
+    unsigned int tail;
+    bool dropped;
+    bool external;
+    uint64_t reads;
+    uint64_t events_read;
+    uint64_t resyncs;
+};
+
+enum record_source {
+    RECORD_TOUCHPAD,
+    RECORD_KEYBOARD,
+    RECORD_SOURCE_MAX,
+};
+
+/* Enough of an evdev device to recreate it through uinput on replay */
+struct record_device {
+    char name[RECORD_NAME_SIZE];
+    struct input_id id;
+    uint8_t key_bits[KEY_CNT / 8];
+    uint8_t rel_bits[REL_CNT / 8];
+    uint8_t abs_bits[ABS_CNT / 8];
+    uint8_t msc_bits[MSC_CNT / 8];
+    uint8_t prop_bits[INPUT_PROP_CNT / 8];
+    struct input_absinfo absinfo[ABS_CNT];
+};
+
+/* One SYN_REPORT frame in a recording, followed by count record_events */
+struct record_frame {
+    uint32_t delta_us;
+    uint16_t source;
+    uint16_t count;
+};
+
+struct record_event {
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+/*
+ * Record mode holds the physical touchpad itself and mirrors its frames
+ * into a uinput clone that libinput reads, since libinput owns the reads
+ * on any fd it is handed.
+ */
+struct recorder {
+    FILE *file;
+    uint64_t last_us;
+    uint64_t frames;
+    int tap_fd;
+    struct libevdev *tap_evdev;
+    struct libevdev_uinput *clone;
+    struct evdev_reader reader;
+};
+
+struct replay {
+    FILE *file;
+    struct record_device devices[RECORD_SOURCE_MAX];
+    struct libevdev_uinput *clones[RECORD_SOURCE_MAX];
+    struct input_event events[READER_MAX_EVENTS];
+    uint64_t time_us;
+};
+
+/*
+ * Scaled motion not yet sent. Whole units go out once per dispatch, the
+ * fraction is carried so slow movement is neither lost nor amplified.
+ */
+struct motion_accum {
+    double x;
+    double y;
+    uint64_t time_us;
+    uint64_t last_us;
+    bool pending;
+};
+
+/* Velocity to gain, sampled from a curve every ACCEL_MAX_VELOCITY / ACCEL_TABLE_SIZE units/ms */
+struct accel_table {
+    double gain[ACCEL_TABLE_SIZE];
+    char curve[ACCEL_CURVE_SIZE];
+};
+
+enum scroll_axis {
+    SCROLL_VERTICAL,
+    SCROLL_HORIZONTAL,
+    SCROLL_AXIS_MAX,
+};
+
+/*
+ * Scroll distance in 1/120 detent units. The fraction is carried between
+ * dispatches; detent counts hi-res units sent since the last REL_WHEEL.
+ */
+struct scroll_accum {
+    double hi_res[SCROLL_AXIS_MAX];
+    int detent[SCROLL_AXIS_MAX];
+    uint64_t time_us;
+    bool pending;
+};
+
+enum mouse_backend {
+    MOUSE_BACKEND_LIBINPUT,
+    MOUSE_BACKEND_NATIVE,
+    MOUSE_BACKEND_PASSTHROUGH,
+    MOUSE_BACKEND_RELATIVE,
+};
+
+struct touch_slot {
+    int tracking_id;
+    int x;
+    int y;
+    int last_x;
+    int last_y;
+    int start_x;
+    int start_y;
+    bool tracked;
+};
+
+/* Tap thresholds shared by all touchpads, a zero timeout turns tapping off */
+struct tap_config {
+    uint64_t timeout_us;
+    uint64_t drag_timeout_us;
+    double move_mm;
+};
+
+/*
+ * One touch sequence, first finger down to last finger up. dead means it
+ * can no longer be a tap; up_us is the last left tap, for tap-and-drag.
+ */
+struct tap_detector {
+    uint64_t down_us;
+    uint64_t up_us;
+    int fingers;
+    bool touching;
+    bool dead;
+    bool drag_armed;
+    bool dragging;
+};
+
+/*
+ * Multitouch state for the native backend, rebuilt from ABS_MT_* frames
+ * without libinput. scale_* converts device units to libinput's 1000dpi.
+ */
+struct touchpad {
+    struct touch_slot slots[TOUCHPAD_MAX_SLOTS];
+    /* Slots the device has, ABS_MT_SLOT's maximum + 1 up to TOUCHPAD_MAX_SLOTS */
+    int slot_count;
+    int slot;
+    int tool_fingers;
+    int last_fingers;
+    /* BTN_LEFT/RIGHT/MIDDLE as bits from BTN_LEFT, and those changed since the last frame */
+    unsigned int buttons;
+    unsigned int buttons_changed;
+    bool button_down;
+    /* INPUT_PROP_BUTTONPAD: one button under the pad, the finger count picks what it clicks */
+    bool clickpad;
+    uint32_t click_button;
+    struct tap_detector tap;
+    double scale_x;
+    double scale_y;
+};
+
 struct virtual_mouse {
+    enum mouse_backend backend;
     struct libinput *libinput_context;
-    struct libevdev_uinput *output_device;
+    struct output_frame frame;
+    struct device_stats stats;
+    struct motion_accum motion;
+    struct scroll_accum scroll;
+    struct touchpad touchpad;
+    struct evdev_reader reader;
+    const struct tap_config *tap;
+    /* Passthrough: a multitouch clone of the touchpad for each output pair */
+    struct libevdev_uinput *passthrough[OUTPUT_POOL_MAX];
+    struct output_sink passthrough_sinks[OUTPUT_POOL_MAX];
+    int passthrough_count;
+    /* Relative sources: REL_X/REL_Y factor, unset or 1 copies them as read */
+    double rel_scale;
+    unsigned int buttons;
+    unsigned int merged;
+    int fd;
     int libinput_fd;
     int evdev_fd;
     bool grabbed;
+    bool exclusive;
+    bool suspended;
+    /* Set with --poll-rate, motion and scroll then wait for its tick */
+    struct output_scheduler *scheduler;
+};
+
+enum chord_action {
+    CHORD_TOGGLE,
+    CHORD_GRAB,
+    CHORD_RELEASE,
+    CHORD_TARGET,
+};
+
+/*
+ * A key combination compiled to a KEY_CNT bitmap; first and last bound
+ * the words holding its bits. Grab actions fire once all its keys are
+ * released again, target switches fire on the completing press.
+ */
+struct chord {
+    unsigned long keys[NLONGS(KEY_CNT)];
+    unsigned int first;
+    unsigned int last;
+    unsigned int key_count;
+    enum chord_action action;
+    int target;
+    bool qemu_toggle;
+};
+
+struct chord_set {
+    struct chord chords[CHORD_MAX];
+    int count;
+};
+
+/*
+ * Source key code to output code, 0 drops the key. hits counts every
+ * lookup so remapped keys can be reported without a branch on the way,
+ * atomic as every keyboard's reader thread shares one keymap.
+ */
+struct keymap {
+    uint16_t codes[KEY_CNT];
+    _Atomic uint64_t hits[KEY_CNT];
+};
+
+/* What becomes of the kernel's key repeats (value 2) on the way to the guest */
+enum repeat_mode {
+    REPEAT_FORWARD,
+    REPEAT_DROP,
+    REPEAT_SYNTH,
+};
+
+/* REPEAT_SYNTH drops host repeats and repeats the last held key itself */
+struct repeat_config {
+    enum repeat_mode mode;
+    unsigned int delay_ms;
+    unsigned int rate;
 };
 
 struct virtual_keyboard {
     struct libevdev *evdev;
-    struct libevdev_uinput *output_device;
+    struct output_frame frame;
+    struct device_stats stats;
+    struct evdev_reader reader;
+    struct recorder *recorder;
+    unsigned long key_state[NLONGS(KEY_CNT)];
+    unsigned int keys_down;
+    const struct chord_set *chords;
+    struct keymap *keymap;
+    const struct repeat_config *repeat;
+    /* timerfd for REPEAT_SYNTH, -1 otherwise; repeat_key is the source code, 0 when idle */
+    int repeat_fd;
+    unsigned int repeat_key;
+    unsigned int repeat_code;
+    /* Host repeats read, and those that did not reach the guest */
+    uint64_t repeats_in;
+    uint64_t repeats_dropped;
+    uint64_t repeats_made;
+    int chord_armed;
+    int switch_target;
+    /* A target chord's completing key, its repeats and key-up are dropped like its press */
+    unsigned int swallowed_key;
+    /* QEMU's input-linux grab is toggled along with ours, the QMP sink has none */
+    bool toggle_qemu;
     int fd;
     bool grabbed;
+    bool exclusive;
+};
+
+/* --realtime settings and the outcome of each step, errno or 0 */
+struct realtime {
+    bool enabled;
+    int priority;
+    int cpu;
+    int sched_error;
+    int mlock_error;
+    int affinity_error;
+};
+
+enum loop_backend {
+    LOOP_EPOLL,
+    LOOP_URING,
 };
 
+struct uring_loop;
+
+enum device_kind {
+    DEVICE_TOUCHPAD,
+    DEVICE_KEYBOARD,
+    DEVICE_KIND_MAX,
+};
+
+/*
+ * One flushed frame in flight from a reader thread to the writer. Its
+ * latency samples ride along and are recorded at the uinput write.
+ */
+struct ring_frame {
+    struct input_event events[FRAME_MAX_EVENTS];
+    unsigned int count;
+    bool urgent;
+    struct output_sink *sink;
+    struct device_stats *stats;
+    struct frame_sample samples[FRAME_MAX_SAMPLES];
+    unsigned int sample_count;
+};
+
+/* Single producer (the reader thread), single consumer (the writer) */
+struct spsc_ring {
+    struct ring_frame frames[RING_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint32_t max_depth;
+    _Atomic uint64_t stalls;
+};
+
+struct input_device;
+
+/*
+ * A reader thread owning one source device. The main thread only touches
+ * the device again after thread_stop has joined it.
+ */
+struct device_thread {
+    pthread_t thread;
+    struct input_device *device;
+    struct virtual_mk *v_mk;
+    struct spsc_ring ring;
+    struct output_sink ring_sink;
+    int wake_fd;
+    _Atomic bool stop;
+    _Atomic bool lost;
+};
+
+/* The main thread's side of the rings, woken once per drain */
+struct thread_writer {
+    struct input_handler handler;
+    int wake_fd;
+    _Atomic bool pending;
+};
+
+/*
+ * Flushes touchpad motion and scroll on a timerfd instead of after every
+ * read, so a fast touchpad is sampled at the guest's poll rate. Buttons
+ * flush their pending motion first and go out with the read as before.
+ */
+struct output_scheduler {
+    struct input_handler handler;
+    unsigned int rate;
+    bool armed;
+    uint64_t ticks;
+    uint64_t flushes;
+};
+
+/* A source device; removed ones are freed after the current event loop batch */
+struct input_device {
+    struct input_handler handler;
+    struct input_handler repeat_handler;
+    struct device_thread *thread;
+    struct virtual_output *output;
+    enum device_kind kind;
+    bool watched;
+    char devnode[DEVICE_NAME_SIZE];
+    char name[DEVICE_NAME_SIZE];
+    bool removed;
+    struct input_device *next;
+    union {
+        struct virtual_mouse mouse;
+        struct virtual_keyboard keyboard;
+    };
+};
+
+/*
+ * Globs matched against a device's node and udev symlinks. A plain path
+ * is also compared after resolving it; "auto" matches by capability.
+ */
+struct device_match {
+    char *patterns[MAX_PATTERNS];
+    char *resolved[MAX_PATTERNS];
+    int count;
+};
+
+/*
+ * A uinput pair one guest sees. All pairs exist from startup, the active
+ * one is shared by every source device.
+ */
+struct virtual_output {
+    struct libevdev_uinput *mouse_device;
+    struct libevdev_uinput *keyboard_device;
+    /* Kept apart from the libevdev handles, which an inherited pair does not have */
+    char mouse_devnode[DEVICE_NAME_SIZE];
+    char keyboard_devnode[DEVICE_NAME_SIZE];
+    /* Inherited and still shared with the process we took over from, never destroyed */
+    bool borrowed;
+    struct output_sink mouse_sink;
+    struct output_sink keyboard_sink;
+    struct qmp_connection qmp;
+};
+
+/*
+ * What a replacement process takes over from the running one: the uinput
+ * pairs, the grab state and which pair input goes to. Source device fds
+ * are kept by handover.c and claimed as the devices are added again.
+ */
+struct handover {
+    int fd;
+    bool grabbed;
+    int output;
+    int output_count;
+    int mouse_fds[OUTPUT_POOL_MAX];
+    int keyboard_fds[OUTPUT_POOL_MAX];
+    char mouse_devnodes[OUTPUT_POOL_MAX][DEVICE_NAME_SIZE];
+    char keyboard_devnodes[OUTPUT_POOL_MAX][DEVICE_NAME_SIZE];
+};
+
+/*
+ * grabbed and output are the wanted state; with reader threads each device
+ * catches up to them on its own thread through device_sync.
+ */
 struct virtual_mk {
-    struct virtual_mouse *mouse;
-    struct virtual_keyboard *keyboard;
+    struct virtual_output *outputs;
+    struct virtual_output *_Atomic output;
+    int output_count;
+    struct input_device *devices;
+    struct device_match *matches;
+    struct chord_set *chords;
+    struct keymap *keymap;
+    const struct tap_config *tap;
+    struct repeat_config repeat;
+    double mouse_scale;
+    const char *accel_file;
+    enum mouse_backend backend;
+    struct recorder *recorder;
+    struct realtime *realtime;
+    struct uring_loop *uring;
+    struct output_scheduler scheduler;
+    struct thread_writer *threads;
+    pthread_mutex_t devices_lock;
+    uint64_t loop_waits;
+    struct udev *udev;
+    struct udev_monitor *monitor;
+    struct input_handler monitor_handler;
+    struct input_handler signal_handler;
+    struct input_handler stats_handler;
+    struct input_handler recorder_handler;
+    struct input_handler handover_handler;
+    _Atomic bool grabbed;
+    bool exclusive;
+    bool reap;
     int epoll_fd;
     int signal_fd;
+    int stats_fd;
+    const char *stats_path;
+    int handover_fd;
+    const char *handover_path;
+    uint64_t start_us;
 };
 
-int mouse_create(const char *path, struct virtual_mouse *mouse);
+void sink_init(struct output_sink *sink, enum sink_type type, int fd);
+void sink_report(const char *name, struct output_sink *sink);
+
+void qmp_init(struct qmp_connection *qmp, const char *path);
+int qmp_watch(struct virtual_mk *v_mk, struct qmp_connection *qmp);
+int sink_qmp_write(struct output_sink *sink, const struct input_event *events, unsigned int count);
+void qmp_close(struct qmp_connection *qmp);
+
+void frame_init(struct output_frame *frame, struct output_sink *sink, struct device_stats *stats);
+int frame_flush(struct output_frame *frame);
+int frame_pass(struct output_frame *frame, const struct input_event *events, unsigned int count);
+void frame_report(const char *name, struct output_frame *frame);
+void frame_record_samples(struct device_stats *stats, const struct frame_sample *samples, unsigned int count);
+
+int reader_fill(struct evdev_reader *reader, int fd);
+void reader_push(struct evdev_reader *reader, const void *data, unsigned int len);
+int reader_next_frame(struct evdev_reader *reader, struct input_event **frame);
+void reader_drain(struct evdev_reader *reader, int fd);
+
+void hist_add(struct latency_hist *hist, uint64_t value);
+uint64_t hist_percentile(const struct latency_hist *hist, double percentile);
+const char *stat_class_name(enum stat_class class);
+int stats_listen(const char *path);
+void stats_serve(struct virtual_mk *v_mk);
+void stats_close(struct virtual_mk *v_mk);
+void stats_loop_report(FILE *out, struct virtual_mk *v_mk);
+
+int output_create(struct virtual_output *output, enum sink_type type, int index,
+    const char *qmp_path, const struct keymap *keymap);
+void output_inherit(struct virtual_output *output, int mouse_fd, int keyboard_fd,
+    const char *mouse_devnode, const char *keyboard_devnode);
+void output_destroy(struct virtual_output *output, int index);
+
+int handover_receive(const char *path, struct handover *handover);
+int handover_open(const char *path, int flags);
+int handover_finish(struct handover *handover, struct virtual_mk *v_mk);
+int handover_listen(struct virtual_mk *v_mk, const char *path);
+void handover_close(struct virtual_mk *v_mk);
+
+void handler_add(struct virtual_mk *v_mk, struct input_handler *handler);
+void handler_remove(struct virtual_mk *v_mk, struct input_handler *handler);
+void handler_modify(struct virtual_mk *v_mk, struct input_handler *handler, uint32_t events);
+
+int sink_ring_write(struct output_sink *sink, const struct input_event *events, unsigned int count);
+int threads_init(struct virtual_mk *v_mk);
+int thread_start(struct virtual_mk *v_mk, struct input_device *device);
+void thread_wake(struct device_thread *thread);
+void thread_stop(struct virtual_mk *v_mk, struct input_device *device);
+void thread_report(FILE *out, struct device_thread *thread);
+void threads_close(struct virtual_mk *v_mk);
+
+int scheduler_init(struct virtual_mk *v_mk, unsigned int rate);
+void scheduler_arm(struct output_scheduler *scheduler);
+void scheduler_report(FILE *out, struct output_scheduler *scheduler);
+void scheduler_close(struct virtual_mk *v_mk);
+
+int uring_create(struct virtual_mk *v_mk);
+int uring_add(struct uring_loop *uring, struct input_handler *handler);
+void uring_remove(struct uring_loop *uring, struct input_handler *handler);
+int uring_write(struct uring_loop *uring, struct output_sink *sink,
+    const struct input_event *events, unsigned int count);
+void uring_run(struct virtual_mk *v_mk);
+void uring_destroy(struct uring_loop *uring);
+int device_add(struct virtual_mk *v_mk, enum device_kind kind, const char *devnode,
+    struct input_device **device);
+void device_remove(struct virtual_mk *v_mk, struct input_device *device);
+void devices_reap(struct virtual_mk *v_mk);
+void devices_close(struct virtual_mk *v_mk);
+bool device_idle(const struct input_device *device);
+void device_sync(struct virtual_mk *v_mk, struct input_device *device);
+void devices_set_grab(struct virtual_mk *v_mk, bool grab);
+void devices_set_target(struct virtual_mk *v_mk, int index);
+int hotplug_init(struct virtual_mk *v_mk);
+void hotplug_close(struct virtual_mk *v_mk);
+
+void realtime_setup(struct realtime *realtime);
+void realtime_report(FILE *out, const struct realtime *realtime);
+
+int recorder_open(struct recorder *recorder, const char *path, const char *touchpad, const char *keyboard);
+const char *recorder_touchpad_devnode(struct recorder *recorder);
+void recorder_write(struct recorder *recorder, enum record_source source,
+    const struct input_event *events, int count);
+void recorder_handle_events(struct recorder *recorder);
+void recorder_close(struct recorder *recorder);
+
+int replay_open(struct replay *replay, const char *path);
+const char *replay_devnode(struct replay *replay, enum record_source source);
+int replay_next(struct replay *replay, enum record_source *source);
+int replay_inject(struct replay *replay, enum record_source source, int count);
+void replay_close(struct replay *replay);
+
+int accel_set(const char *curve);
+int accel_load(const char *path);
+double accel_gain(double velocity);
+const char *accel_curve(void);
+void accel_close(void);
+
+int setup_virtual_mouse(struct libevdev_uinput **output_device, int index);
+int setup_virtual_touchpad(struct libevdev_uinput **output_device, int index, int source_fd);
+int mouse_create(const char *path, struct virtual_mouse *mouse, struct output_sink *sink);
 void mouse_handle_events(struct virtual_mouse *mouse);
 void mouse_grab_global(struct virtual_mouse *mouse, bool grab);
+void mouse_suspend(struct virtual_mouse *mouse);
+int mouse_resume(struct virtual_mouse *mouse);
 void mouse_close(struct virtual_mouse *mouse);
+void mouse_release_buttons(struct virtual_mouse *mouse);
+void mouse_motion(struct virtual_mouse *mouse, double dx, double dy, uint64_t time_us);
+void mouse_button(struct virtual_mouse *mouse, uint32_t button, int state, uint64_t time_us);
+void mouse_scroll(struct virtual_mouse *mouse, enum scroll_axis axis, double value, uint64_t time_us);
+void mouse_flush(struct virtual_mouse *mouse);
+
+int touchpad_create(const char *path, struct virtual_mouse *mouse);
+void touchpad_handle_events(struct virtual_mouse *mouse);
+int touchpad_passthrough_create(struct virtual_mouse *mouse, struct virtual_output *outputs, int count);
+void touchpad_passthrough_events(struct virtual_mouse *mouse);
+void touchpad_passthrough_release(struct virtual_mouse *mouse);
 
-int keyboard_create(const char *path, struct virtual_keyboard *keyboard);
+bool relative_probe(const char *path);
+int relative_create(const char *path, struct virtual_mouse *mouse);
+void relative_handle_events(struct virtual_mouse *mouse);
+void relative_resume(struct virtual_mouse *mouse);
+void touchpad_resume(struct virtual_mouse *mouse);
+void touchpad_close(struct virtual_mouse *mouse);
+
+int key_from_name(const char *name);
+void keymap_init(struct keymap *keymap);
+int keymap_load(struct keymap *keymap, const char *path);
+void keymap_report(FILE *out, const struct keymap *keymap);
+
+int chord_compile(struct chord_set *set, const char *spec);
+void chord_defaults(struct chord_set *set, int outputs);
+int chord_match(const struct chord_set *set, const unsigned long *key_state,
+    unsigned int keys_down, unsigned int code);
+bool chord_released(const struct chord *chord, const unsigned long *key_state);
+
+int setup_keyboard(struct libevdev_uinput **output_device, int index, const struct keymap *keymap);
+int keyboard_create(const char *path, struct virtual_keyboard *keyboard, struct output_sink *sink);
+void keyboard_release_keys(struct virtual_keyboard *keyboard);
 void keyboard_flush(struct virtual_keyboard *keyboard);
 void keyboard_grab_global(struct virtual_keyboard *keyboard, bool flag);
 void keyboard_handle_events(struct virtual_keyboard *keyboard);
+void keyboard_repeat(struct virtual_keyboard *keyboard);
+void keyboard_report(FILE *out, struct virtual_keyboard *keyboard);
 void keyboard_close(struct virtual_keyboard *keyboard);
 
-static inline double floor_or_ceil(double val) {
-    double ret = 0;
+static inline bool bit_is_set(const unsigned long *array, unsigned int bit)
+{
+    return array[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG));
+}
 
-    if (val > (double)0)
-        ret = ceil(val);
+static inline void set_bit(unsigned long *array, unsigned int bit, bool value)
+{
+    if (value)
+        array[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
     else
-        ret = floor(val);  
+        array[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+static inline uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t event_time_us(const struct input_event *event)
+{
+    return (uint64_t)event->input_event_sec * 1000000 + event->input_event_usec;
+}
+
+static inline void frame_write(struct output_frame *frame, uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event *event;
+
+    if (frame->count == FRAME_MAX_EVENTS)
+        frame_flush(frame);
+
+    event = &frame->events[frame->count++];
+    event->type = type;
+    event->code = code;
+    event->value = value;
+}
+
+static inline void frame_sync(struct output_frame *frame)
+{
+    frame_write(frame, EV_SYN, SYN_REPORT, 0);
+}
+
+/* Time the frame being built against the source event that produced it */
+static inline void frame_mark(struct output_frame *frame, enum stat_class class, uint64_t time_us)
+{
+    if (!frame->stats)
+        return;
 
-    return ret;
+    frame->stats->events[class]++;
+    if (frame->sample_count < FRAME_MAX_SAMPLES) {
+        frame->samples[frame->sample_count].time_us = time_us;
+        frame->samples[frame->sample_count].class = class;
+        frame->sample_count++;
+    }
 }